@@ -0,0 +1,253 @@
+/* diff.c - change sets against an earlier netmask output
+ *
+ * Copyright (c) 2025  Robert Stone <talby@trap.mtview.ca.us>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "diff.h"
+#include "errors.h"
+#include "reader.h"
+#include "u128.h"
+
+/* most words on a line, the binary style has 33 */
+#define DIFF_WORDS 40
+
+struct diff {
+    NM old;
+    NM_ITER it;
+    nm_cidr cur;
+    int have;
+    nm_walk_cb gone, added;
+    void *user;
+    size_t plus, minus;
+};
+
+/* the length of a mask len bytes long, or -1 if it is not one */
+static int mask_len(const uint8_t *mask, int len) {
+    int n = 0, i;
+
+    for (i = 0; i < len && mask[i] == 0xff; i++) n += 8;
+    if (i < len) {
+        uint8_t b = mask[i++];
+        if ((uint8_t)(b << u64_popc(b)) != 0) return -1;
+        n += u64_popc(b);
+    }
+    for (; i < len; i++)
+        if (mask[i]) return -1;
+    return n;
+}
+
+/* reads digits of bs bits each into len big endian bytes, the way
+ * num_str() in main.c wrote them */
+static int num_bytes(const char *s, size_t digits, int bs, uint8_t *dst,
+        int len) {
+    memset(dst, 0, len);
+    for (size_t j = 0; j < digits; j++) {
+        int d, carry;
+        if (s[j] >= '0' && s[j] <= '9') d = s[j] - '0';
+        else if (s[j] >= 'a' && s[j] <= 'f') d = s[j] - 'a' + 10;
+        else return 0;
+        if (d >> bs || dst[0] >> (8 - bs)) return 0;
+        carry = d;
+        for (int i = len - 1; i >= 0; i--) {
+            int v = dst[i] << bs | carry;
+            dst[i] = v & 0xff;
+            carry = v >> 8;
+        }
+    }
+    return 1;
+}
+
+/* an "address/length" spec from the pair, 4 or 16 bytes each */
+static int spec_of(char *spec, const uint8_t *addr, const uint8_t *mask,
+        int len) {
+    int n = mask_len(mask, len);
+
+    if (n < 0 || !inet_ntop(len == 4 ? AF_INET : AF_INET6, addr, spec,
+            INET6_ADDRSTRLEN)) return 0;
+    sprintf(spec + strlen(spec), "/%d", n);
+    return 1;
+}
+
+/* the hex and octal styles, "0xN/0xN" and "0N/0N" */
+static int parse_num(char *spec, const char *w) {
+    int bs = strncmp(w, "0x", 2) ? 3 : 4;
+    const char *a = w + (bs == 4 ? 2 : 1), *m, *p = strchr(w, '/');
+    size_t digits;
+    uint8_t addr[16], mask[16];
+    int len;
+
+    if (!p) return 0;
+    digits = p - a;
+    m = p + (bs == 4 ? 3 : 2);
+    if (strncmp(p + 1, bs == 4 ? "0x" : "0", m - p - 1)) return 0;
+    len = digits * bs / 8;
+    if ((len != 4 && len != 16) || strlen(m) != digits ||
+            !num_bytes(a, digits, bs, addr, len) ||
+            !num_bytes(m, digits, bs, mask, len)) return 0;
+    return spec_of(spec, addr, mask, len);
+}
+
+/* the binary style, a byte to a word with "/" between the two */
+static int parse_binary(char *spec, char **w, int n) {
+    uint8_t addr[16], mask[16];
+    int len = n / 2;
+
+    if ((len != 4 && len != 16) || strcmp(w[len], "/")) return 0;
+    for (int i = 0; i < len; i++) {
+        if (strlen(w[i]) != 8 || strlen(w[len + 1 + i]) != 8 ||
+                !num_bytes(w[i], 8, 1, addr + i, 1) ||
+                !num_bytes(w[len + 1 + i], 8, 1, mask + i, 1)) return 0;
+    }
+    return spec_of(spec, addr, mask, len);
+}
+
+/* the cisco style, an address and its wildcard bits */
+static int parse_cisco(char *spec, char **w) {
+    uint8_t addr[16], mask[16];
+    int len = strchr(w[0], ':') ? 16 : 4;
+
+    if (inet_pton(len == 4 ? AF_INET : AF_INET6, w[0], addr) != 1 ||
+            inet_pton(len == 4 ? AF_INET : AF_INET6, w[1], mask) != 1)
+        return 0;
+    for (int i = 0; i < len; i++) mask[i] = ~mask[i];
+    return spec_of(spec, addr, mask, len);
+}
+
+/* turns one output line into something nm_new_str() reads */
+static int parse_line(char *spec, char **w, int n) {
+    if (n == 1 && strpbrk(w[0], ".:")) {
+        /* the CIDR and standard styles already are */
+        if (strlen(w[0]) >= 128) return 0;
+        strcpy(spec, w[0]);
+        return 1;
+    } else if (n == 1 && w[0][0] == '0') {
+        return parse_num(spec, w[0]);
+    } else if (n == 2 && w[1][0] == '(') {
+        /* the range style, "first-last (count)" */
+        char *p = strchr(w[0], '-');
+        if (!p || strlen(w[0]) >= 128) return 0;
+        strcpy(spec, w[0]);
+        spec[p - w[0]] = ',';
+        return 1;
+    } else if (n == 2) {
+        return parse_cisco(spec, w);
+    }
+    return parse_binary(spec, w, n);
+}
+
+/* merges every line of the file into *old, -1 if any is no good */
+static int load(const char *path, NM *old) {
+    READER rd = reader_open(path, 0, NULL);
+    const char *word;
+    char buf[DIFF_WORDS][128], *w[DIFF_WORDS], spec[128];
+    size_t line = 0, bad = 0;
+    int n = 0;
+
+    if (!rd) {
+        warn("open: %s", path);
+        return -1;
+    }
+    for (int i = 0; i < DIFF_WORDS; i++) w[i] = buf[i];
+    do {
+        word = reader_word(rd);
+        if (n && (!word || reader_line(rd) != line)) {
+            NM nm = NULL;
+            if (n <= DIFF_WORDS && parse_line(spec, w, n))
+                nm = nm_new_str(spec, 0);
+            if (nm) {
+                *old = nm_merge(*old, nm);
+            } else {
+                errno = 0;
+                warn("%s:%zu: not a netmask output line", path, line);
+                bad++;
+            }
+            n = 0;
+        }
+        if (word) {
+            line = reader_line(rd);
+            if (n < DIFF_WORDS) snprintf(w[n], sizeof(buf[n]), "%s", word);
+            n++;
+        }
+    } while (word);
+    if (reader_close(rd) < 0) return -1;
+    return bad ? -1 : 0;
+}
+
+DIFF diff_new(const char *path, nm_walk_cb gone, nm_walk_cb added,
+        void *user) {
+    NM old = NULL;
+    DIFF d;
+
+    if (load(path, &old) < 0) {
+        if (old) nm_free(old);
+        return NULL;
+    }
+    d = calloc(1, sizeof(struct diff));
+    d->old = old;
+    d->it = nm_iter_new(old);
+    d->have = nm_iter_next(d->it, &d->cur);
+    d->gone = gone;
+    d->added = added;
+    d->user = user;
+    return d;
+}
+
+/* prefixes in a tree never overlap, so the address alone orders them */
+static inline int cidr_cmp(nm_cidr *a, nm_cidr *b) {
+    int rv = memcmp(&a->addr.s6, &b->addr.s6, sizeof(a->addr.s6));
+    return rv ? rv : a->scope - b->scope;
+}
+
+static inline void diff_gone(DIFF d) {
+    d->gone(&d->cur, d->user);
+    d->minus++;
+    d->have = nm_iter_next(d->it, &d->cur);
+}
+
+/* one step of a merge join between the file and the walk.  A prefix
+ * that only changed notation, IPv4 or IPv6, prints differently and so
+ * counts as a change. */
+void diff_cb(nm_cidr *c, void *user) {
+    DIFF d = user;
+    int cmp = -1;
+
+    while (d->have && (cmp = cidr_cmp(&d->cur, c)) < 0)
+        diff_gone(d);
+    if (d->have && cmp == 0) {
+        if (d->cur.domain == c->domain) {
+            d->have = nm_iter_next(d->it, &d->cur);
+            return;
+        }
+        diff_gone(d);
+    }
+    d->added(c, d->user);
+    d->plus++;
+}
+
+void diff_free(DIFF d) {
+    while (d->have) diff_gone(d);
+    status("%zu prefixes added, %zu removed", d->plus, d->minus);
+    nm_iter_free(d->it);
+    if (d->old) nm_free(d->old);
+    free(d);
+}
@@ -0,0 +1,40 @@
+/* diff.h - change sets against an earlier netmask output
+ *
+ * Copyright (c) 2025  Robert Stone <talby@trap.mtview.ca.us>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+#ifndef _HAVE_DIFF_H
+#define _HAVE_DIFF_H
+
+#include "netmask.h"
+
+/* A walk callback that compares the prefixes it is given, in address
+ * order, against those in a file netmask wrote earlier in any of its
+ * output styles.  Prefixes only in the file go to gone and prefixes
+ * only in the walk go to added, both with user, so the two come out
+ * merged in address order.  diff_new() returns NULL after warning if
+ * the file can not be read or has lines it does not recognize. */
+typedef struct diff *DIFF;
+
+DIFF diff_new(const char *path, nm_walk_cb gone, nm_walk_cb added,
+    void *user);
+
+void diff_cb(nm_cidr *, void *diff);
+
+/* hands what is left of the file to gone and reports the counts as a
+ * status message */
+void diff_free(DIFF);
+#endif
@@ -0,0 +1,302 @@
+/* dnscache.c - hostname answers kept between runs
+ *
+ * Copyright (c) 2025  Robert Stone <talby@trap.mtview.ca.us>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dnscache.h"
+#include "errors.h"
+
+/* The file has a line for each name, "expires name address ...", with
+ * expires in seconds since the epoch. */
+
+#define DNSCACHE_MIN_BITS 10
+
+struct dns_addr {
+    int family;
+    nm_addr a;
+};
+
+struct dns_entry {
+    char *name; /* NULL for an empty slot */
+    time_t expires;
+    size_t n;
+    struct dns_addr *addr;
+};
+
+struct dnscache {
+    char *path;
+    unsigned long ttl;
+    struct dns_entry *slot;
+    size_t bits, fill;
+    int dirty;
+    size_t hits, lookups, stale;
+};
+
+static inline size_t name_hash(DNSCACHE c, const char *name) {
+    /* FNV-1a */
+    uint64_t v = 0xcbf29ce484222325ULL;
+    for (; *name; name++) v = (v ^ (uint8_t)*name) * 0x100000001b3ULL;
+    return (v ^ v >> 29) * 0xbf58476d1ce4e5b9ULL >> (64 - c->bits);
+}
+
+/* the entry for a name, or the empty slot it would go in */
+static struct dns_entry *find(DNSCACHE c, const char *name) {
+    size_t mask = ((size_t)1 << c->bits) - 1;
+    for (size_t i = name_hash(c, name);; i = (i + 1) & mask) {
+        struct dns_entry *e = &c->slot[i];
+        if (!e->name || !strcmp(e->name, name)) return e;
+    }
+}
+
+static void grow(DNSCACHE c) {
+    struct dns_entry *old = c->slot;
+    size_t n = (size_t)1 << c->bits;
+
+    c->bits++;
+    c->slot = calloc((size_t)1 << c->bits, sizeof(struct dns_entry));
+    for (size_t i = 0; i < n; i++)
+        if (old[i].name) *find(c, old[i].name) = old[i];
+    free(old);
+}
+
+/* takes over addr, keeping whichever answer is good for longer */
+static void store(DNSCACHE c, const char *name, time_t expires,
+        struct dns_addr *addr, size_t n) {
+    struct dns_entry *e = find(c, name);
+
+    if (e->name && e->expires >= expires) {
+        free(addr);
+        return;
+    }
+    if (e->name) {
+        free(e->addr);
+    } else {
+        e->name = strdup(name);
+        c->fill++;
+    }
+    e->expires = expires;
+    e->addr = addr;
+    e->n = n;
+    if (2 * c->fill > ((size_t)1 << c->bits)) grow(c);
+}
+
+static void read_cache(DNSCACHE c, FILE *fp) {
+    char *line = NULL, *save, *name, *word;
+    size_t size = 0;
+
+    while (getline(&line, &size, fp) >= 0) {
+        struct dns_addr *addr;
+        size_t n = 0;
+        char *end;
+        time_t expires;
+
+        if (!(word = strtok_r(line, " \t\n", &save))) continue;
+        expires = strtoll(word, &end, 10);
+        if (*end || !(name = strtok_r(NULL, " \t\n", &save))) continue;
+        addr = NULL;
+        while ((word = strtok_r(NULL, " \t\n", &save))) {
+            struct dns_addr *a;
+            addr = realloc(addr, (n + 1) * sizeof(struct dns_addr));
+            a = &addr[n];
+            a->family = strchr(word, ':') ? AF_INET6 : AF_INET;
+            if (inet_pton(a->family, word, a->family == AF_INET ?
+                    (void *)&a->a.s : (void *)&a->a.s6) == 1) n++;
+        }
+        if (n) store(c, name, expires, addr, n);
+        else free(addr);
+    }
+    free(line);
+}
+
+/* a lock on a file next to the cache, as the cache itself is replaced
+ * rather than written in place.  Returns the descriptor holding it. */
+static int lock(DNSCACHE c, short type) {
+    char path[4096];
+    struct flock fl = { .l_type = type, .l_whence = SEEK_SET };
+    int fd;
+
+    snprintf(path, sizeof(path), "%s.lock", c->path);
+    if ((fd = open(path, O_RDWR | O_CREAT, 0666)) < 0) return -1;
+    while (fcntl(fd, F_SETLKW, &fl) < 0) {
+        if (errno != EINTR) {
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+/* merge in the file as it is now */
+static int reread(DNSCACHE c) {
+    FILE *fp = fopen(c->path, "r");
+
+    if (!fp) return errno == ENOENT ? 0 : -1;
+    read_cache(c, fp);
+    fclose(fp);
+    return 0;
+}
+
+DNSCACHE dnscache_open(const char *path, unsigned long ttl) {
+    DNSCACHE c = calloc(1, sizeof(struct dnscache));
+    int fd;
+
+    c->path = strdup(path);
+    c->ttl = ttl;
+    c->bits = DNSCACHE_MIN_BITS;
+    c->slot = calloc((size_t)1 << c->bits, sizeof(struct dns_entry));
+    /* replacing the file is atomic, so the lock is only a courtesy to a
+     * writer about to rename over it, and may be missing */
+    fd = lock(c, F_RDLCK);
+    if (reread(c) < 0) {
+        warn("dns cache: %s", path);
+        if (fd >= 0) close(fd);
+        dnscache_free(c);
+        return NULL;
+    }
+    if (fd >= 0) close(fd);
+    return c;
+}
+
+static NM tree_of(struct dns_entry *e) {
+    NM self = NULL;
+
+    for (size_t i = 0; i < e->n; i++) {
+        struct dns_addr *a = &e->addr[i];
+        self = nm_merge(self, a->family == AF_INET ?
+            nm_new_v4(&a->a.s) : nm_new_v6(&a->a.s6));
+    }
+    return self;
+}
+
+NM dnscache_resolve(const char *name, void *user) {
+    DNSCACHE c = user;
+    struct dns_entry *e = find(c, name);
+    struct addrinfo in, *out, *cur;
+    struct dns_addr *addr;
+    time_t now = time(NULL);
+    size_t n = 0;
+    NM self;
+
+    if (e->name && e->expires > now) {
+        c->hits++;
+        return tree_of(e);
+    }
+    memset(&in, 0, sizeof(struct addrinfo));
+    in.ai_family = AF_UNSPEC;
+    /* one answer per address, not one per socket type */
+    in.ai_socktype = SOCK_STREAM;
+    c->lookups++;
+    if (getaddrinfo(name, NULL, &in, &out) != 0) {
+        if (!e->name) return NULL;
+        c->stale++;
+        return tree_of(e);
+    }
+    for (cur = out; cur; cur = cur->ai_next) n++;
+    addr = calloc(n, sizeof(struct dns_addr));
+    for (n = 0, cur = out; cur; cur = cur->ai_next, n++) {
+        addr[n].family = cur->ai_family;
+        if (cur->ai_family == AF_INET)
+            addr[n].a.s = ((struct sockaddr_in *)cur->ai_addr)->sin_addr;
+        else
+            addr[n].a.s6 = ((struct sockaddr_in6 *)cur->ai_addr)->sin6_addr;
+    }
+    self = nm_new_ai(out);
+    freeaddrinfo(out);
+    store(c, name, now + c->ttl, addr, n);
+    c->dirty = 1;
+    return self;
+}
+
+static int write_cache(DNSCACHE c, FILE *fp) {
+    time_t now = time(NULL);
+    char buf[INET6_ADDRSTRLEN];
+
+    for (size_t i = 0; i < (size_t)1 << c->bits; i++) {
+        struct dns_entry *e = &c->slot[i];
+        /* this is where the file is compacted */
+        if (!e->name || e->expires <= now) continue;
+        fprintf(fp, "%lld %s", (long long)e->expires, e->name);
+        for (size_t j = 0; j < e->n; j++) {
+            struct dns_addr *a = &e->addr[j];
+            inet_ntop(a->family, a->family == AF_INET ?
+                (void *)&a->a.s : (void *)&a->a.s6, buf, sizeof(buf));
+            fprintf(fp, " %s", buf);
+        }
+        fputc('\n', fp);
+    }
+    return fflush(fp) == 0 && fsync(fileno(fp)) == 0 ? 0 : -1;
+}
+
+int dnscache_save(DNSCACHE c) {
+    char tmp[4096];
+    mode_t mask;
+    FILE *fp;
+    int fd, lk, rv = -1;
+
+    status("dns cache: %zu hits, %zu lookups, %zu stale answers",
+        c->hits, c->lookups, c->stale);
+    if (!c->dirty) return 0;
+    if ((lk = lock(c, F_WRLCK)) < 0) {
+        warn("dns cache: lock %s", c->path);
+        return -1;
+    }
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", c->path);
+    if (reread(c) < 0 || (fd = mkstemp(tmp)) < 0) {
+        warn("dns cache: %s", c->path);
+        close(lk);
+        return -1;
+    }
+    /* mkstemp() leaves out everyone else, which a cache need not */
+    mask = umask(0);
+    umask(mask);
+    fchmod(fd, 0666 & ~mask);
+    if (!(fp = fdopen(fd, "w"))) {
+        close(fd);
+    } else {
+        rv = write_cache(c, fp);
+        if (fclose(fp) != 0) rv = -1;
+        if (rv == 0 && rename(tmp, c->path) < 0) rv = -1;
+    }
+    if (rv < 0) {
+        warn("dns cache: %s", c->path);
+        unlink(tmp);
+    } else {
+        c->dirty = 0;
+    }
+    close(lk);
+    return rv;
+}
+
+void dnscache_free(DNSCACHE c) {
+    for (size_t i = 0; i < (size_t)1 << c->bits; i++) {
+        free(c->slot[i].name);
+        free(c->slot[i].addr);
+    }
+    free(c->slot);
+    free(c->path);
+    free(c);
+}
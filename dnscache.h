@@ -0,0 +1,43 @@
+/* dnscache.h - hostname answers kept between runs
+ *
+ * Copyright (c) 2025  Robert Stone <talby@trap.mtview.ca.us>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+#ifndef _HAVE_DNSCACHE_H
+#define _HAVE_DNSCACHE_H
+
+#include "netmask.h"
+
+/* A file of resolved names, each with the addresses it had and when
+ * that stops being good, ttl seconds after the lookup.  Install
+ * dnscache_resolve() with nm_resolver() and the cache as user data.
+ * A name past its time is looked up again, but its old addresses still
+ * answer if that fails.  dnscache_open() returns NULL after warning if
+ * the file exists but can not be read. */
+typedef struct dnscache *DNSCACHE;
+
+DNSCACHE dnscache_open(const char *path, unsigned long ttl);
+
+NM dnscache_resolve(const char *name, void *cache);
+
+/* writes new answers out if there are any, merged with what other runs
+ * wrote meanwhile and without the entries that have run out.  The file
+ * is locked while this happens and replaced in one step, so concurrent
+ * runs never see half of it.  Returns -1 after warning on failure. */
+int dnscache_save(DNSCACHE);
+
+void dnscache_free(DNSCACHE);
+#endif
@@ -61,7 +61,7 @@ int initerrors(char *pn, int type, int stat) {
 }
 
 int status(const char *fmt, ...) {
-    static char buf[1024];
+    char buf[1024];
     va_list args;
 
     if(!show_status) return(0);
@@ -72,7 +72,7 @@ int status(const char *fmt, ...) {
 }
 
 int warn(const char *fmt, ...) {
-    static char buf[1024];
+    char buf[1024];
     va_list args;
 
     va_start(args, fmt);
@@ -82,7 +82,7 @@ int warn(const char *fmt, ...) {
 }
 
 int panic(const char *fmt, ...) {
-    static char buf[1024];
+    char buf[1024];
     va_list args;
 
     va_start(args, fmt);
@@ -99,8 +99,9 @@ int message(int priority, const char *msg) {
     if(errno && priority < 5) {
 	snprintf(buf, sizeof(buf), "%s: %s", msg, strerror(errno));
 	errno = 0;
-    } else strcpy(buf, msg);
-    if(use_syslog) syslog(priority, "%s", buf);
-    else           fprintf(stderr, "%s: %s\n", progname, buf);
+	msg = buf;
+    }
+    if(use_syslog) syslog(priority, "%s", msg);
+    else           fprintf(stderr, "%s: %s\n", progname, msg);
     return(0);
 }
@@ -0,0 +1,181 @@
+/* expand.c - controlled prefix expansion for netmask
+ *
+ * Copyright (c) 2025  Robert Stone <talby@trap.mtview.ca.us>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "errors.h"
+#include "expand.h"
+#include "u128.h"
+
+#define EXPAND_NONE 0xff
+
+struct expand {
+    /* the shortest allowed length at or beyond each length, in IPv6
+     * bits, or EXPAND_NONE */
+    uint8_t v4[129], v6[129];
+    nm_walk_cb cb;
+    void *user;
+    size_t in, out, dropped;
+    /* dropping is asked for, not a failure */
+    int quiet;
+};
+
+EXPAND expand_new(const char *lengths, nm_walk_cb cb, void *user) {
+    uint8_t allow[129] = { 0 };
+    const char *p = lengths;
+    char *end;
+    EXPAND e;
+
+    do {
+        unsigned long len = strtoul(p, &end, 10);
+        if (end == p || len > 128 || (*end && *end != ','))
+            return NULL;
+        allow[len] = 1;
+        p = end + 1;
+    } while (*end);
+
+    e = calloc(1, sizeof(struct expand));
+    e->cb = cb;
+    e->user = user;
+    e->v4[128] = allow[32] ? 128 : EXPAND_NONE;
+    e->v6[128] = allow[128] ? 128 : EXPAND_NONE;
+    for (int len = 127; len >= 0; len--) {
+        e->v4[len] = len >= 96 && allow[len - 96] ? len : e->v4[len + 1];
+        e->v6[len] = allow[len] ? len : e->v6[len + 1];
+    }
+    return e;
+}
+
+/* the length a prefix of len bits becomes, base being 96 for IPv4 */
+static uint8_t limit(int len, int min, int max, int base) {
+    if (min >= 0 && len > base + min) return EXPAND_NONE;
+    if (max >= 0 && len < base + max) return base + max;
+    return len;
+}
+
+/* "len" or "len4,len6" into a limit for each family, -1 where there is
+ * none.  A single length up to 32 is taken for IPv4 only and a longer
+ * one for IPv6 only, so a limit meant for one never eats the other. */
+static int parse_limit(const char *str, int lim[2]) {
+    const char *p;
+    char *end;
+    long a, b;
+
+    lim[0] = lim[1] = -1;
+    if (!str) return 0;
+    a = strtol(str, &end, 10);
+    if (end == str || a < 0 || a > 128) return -1;
+    if (*end == ',') {
+        p = end + 1;
+        b = strtol(p, &end, 10);
+        if (end == p || *end || a > 32 || b < 0 || b > 128) return -1;
+        lim[0] = a;
+        lim[1] = b;
+    } else if (*end) {
+        return -1;
+    } else {
+        lim[a > 32] = a;
+    }
+    return 0;
+}
+
+EXPAND expand_limits(const char *min, const char *max, nm_walk_cb cb,
+        void *user) {
+    int lo[2], hi[2];
+    EXPAND e;
+
+    errno = 0;
+    if (parse_limit(min, lo) < 0) {
+        warn("bad length \"%s\" for --min", min);
+        return NULL;
+    }
+    if (parse_limit(max, hi) < 0) {
+        warn("bad length \"%s\" for --max", max);
+        return NULL;
+    }
+    for (int f = 0; f < 2; f++) {
+        if (lo[f] >= 0 && hi[f] > lo[f]) {
+            warn("--max /%d is longer than --min /%d for %s", hi[f], lo[f],
+                f ? "IPv6" : "IPv4");
+            return NULL;
+        }
+    }
+    e = calloc(1, sizeof(struct expand));
+    e->cb = cb;
+    e->user = user;
+    e->quiet = 1;
+    for (int len = 0; len <= 128; len++) {
+        e->v4[len] = limit(len, lo[0], hi[0], 96);
+        e->v6[len] = limit(len, lo[1], hi[1], 0);
+    }
+    return e;
+}
+
+/* every prefix of the new length inside this one, one at a time, so a
+ * short prefix never costs more than its output */
+void expand_cb(nm_cidr *c, void *user) {
+    EXPAND e = user;
+    uint8_t len = (c->domain == AF_INET ? e->v4 : e->v6)[c->scope];
+    u128_t cur, last, step;
+    nm_cidr x = *c;
+
+    e->in++;
+    if (len == EXPAND_NONE && e->quiet) {
+        e->dropped++;
+        return;
+    }
+    if (len == EXPAND_NONE) {
+        char buf[INET6_ADDRSTRLEN];
+        inet_ntop(c->domain, c->domain == AF_INET ?
+            (void *)&c->addr.s : (void *)&c->addr.s6, buf, sizeof(buf));
+        warn("no allowed length for %s/%d", buf,
+            c->scope - (c->domain == AF_INET ? 96 : 0));
+        e->dropped++;
+        return;
+    }
+    cur = u128_of_v6(&c->addr.s6);
+    last = u128_and(u128_or(cur, u128_not(u128_mask(c->scope))),
+        u128_mask(len));
+    step = u128_add(u128_not(u128_mask(len)), u128(0, 1), NULL);
+    x.scope = len;
+    for (;;) {
+        /* formatters may scribble on what they are given */
+        x.addr.s6 = v6_of_u128(cur);
+        x.mask.s6 = v6_of_u128(u128_mask(len));
+        e->cb(&x, e->user);
+        e->out++;
+        if (!u128_cmp(cur, last)) break;
+        cur = u128_add(cur, step, NULL);
+    }
+}
+
+size_t expand_free(EXPAND e) {
+    size_t dropped = e->quiet ? 0 : e->dropped;
+    if (e->quiet)
+        status("limited %zu prefixes to %zu, leaving out %zu", e->in,
+            e->out, e->dropped);
+    else
+        status("expanded %zu prefixes to %zu, a factor of %.2f", e->in,
+            e->out, e->in ? (double)e->out / e->in : 1.0);
+    free(e);
+    return dropped;
+}
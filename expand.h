@@ -0,0 +1,49 @@
+/* expand.h - controlled prefix expansion for netmask
+ *
+ * Copyright (c) 2025  Robert Stone <talby@trap.mtview.ca.us>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+#ifndef _HAVE_EXPAND_H
+#define _HAVE_EXPAND_H
+
+#include "netmask.h"
+
+/* A walk callback that rewrites each prefix as the prefixes of the next
+ * allowed length that cover the same addresses, for lookup tables that
+ * can only hold a few lengths, and hands them on to cb.  lengths is a
+ * comma separated list; IPv4 prefixes use the ones up to 32 counted in
+ * IPv4 bits, IPv6 prefixes use all of them.  expand_new() returns NULL
+ * if the list does not parse. */
+typedef struct expand *EXPAND;
+
+EXPAND expand_new(const char *lengths, nm_walk_cb cb, void *user);
+
+/* the same for --min and --max: prefixes longer than min bits are left
+ * out without a word, and those shorter than max bits are rewritten as
+ * prefixes of max bits.  Each is "len" or "len4,len6", or NULL for no
+ * limit.  A single length up to 32 applies to IPv4 only, counted in
+ * IPv4 bits, and a longer one to IPv6 only.  Returns NULL after warning
+ * if a length does not parse or max is longer than min. */
+EXPAND expand_limits(const char *min, const char *max, nm_walk_cb cb,
+    void *user);
+
+void expand_cb(nm_cidr *, void *expand);
+
+/* reports the expansion factor as a status message and returns how many
+ * prefixes were longer than any allowed length and so left out, or 0
+ * for limits, where leaving them out is the point */
+size_t expand_free(EXPAND);
+#endif
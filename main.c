@@ -20,18 +20,29 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #include <math.h>
 
 #include "netmask.h"
+#include "diff.h"
+#include "dnscache.h"
 #include "errors.h"
+#include "expand.h"
+#include "reader.h"
+#include "render.h"
+#include "mmdb.h"
+#include "serve.h"
+#include "spill.h"
 #include "config.h"
 
 struct option longopts[] = {
@@ -47,8 +58,29 @@ struct option longopts[] = {
   { "binary",	0, 0, 'b' },
   { "nodns",	0, 0, 'n' },
   { "files",	0, 0, 'f' },
-//  { "max",	1, 0, 'M' },
-//  { "min",	1, 0, 'm' },
+  { "memory",	1, 0, 'L' },
+  { "sorted",	0, 0, 'S' },
+  { "max-errors", 1, 0, 'E' },
+  { "comments",	0, 0, 'C' },
+  { "dedup",	0, 0, 'D' },
+  { "serve",	1, 0, 'Q' },
+  { "query",	1, 0, 'q' },
+  { "jobs",	1, 0, 'j' },
+  { "json",	1, 0, 'J' },
+  { "csv",	1, 0, 'V' },
+  { "mmdb",	1, 0, 'B' },
+  { "expand",	1, 0, 'X' },
+  { "top",	1, 0, 'K' },
+  { "diff-against", 1, 0, 'A' },
+  { "dns-cache", 1, 0, 'N' },
+  { "dns-ttl",	1, 0, 'T' },
+  { "node-budget", 1, 0, 'U' },
+  { "sweep",	0, 0, 'W' },
+  { "tenants",	1, 0, 'Y' },
+  { "shards",	1, 0, 'H' },
+  { "output-prefix", 1, 0, 'O' },
+  { "max",	1, 0, 'M' },
+  { "min",	1, 0, 'm' },
   { NULL,	0, 0, 0   }
 };
 
@@ -65,13 +97,14 @@ static void nm_ntop(int domain, nm_addr *addr, char *dst) {
     inet_ntop(domain, src, dst, INET6_ADDRSTRLEN);
 }
 
+/* the disp_* walk callbacks print to the FILE * passed as user data */
 void disp_std(nm_cidr *c, void *user) {
   char nb[INET6_ADDRSTRLEN + 1],
        mb[INET6_ADDRSTRLEN + 1];
 
   nm_ntop(c->domain, &c->addr, nb);
   nm_ntop(c->domain, &c->mask, mb);
-  printf("%15s/%-15s\n", nb, mb);
+  fprintf(user, "%15s/%-15s\n", nb, mb);
 }
 
 static void disp_cidr(nm_cidr *c, void *user) {
@@ -79,7 +112,7 @@ static void disp_cidr(nm_cidr *c, void *user) {
 
   nm_ntop(c->domain, &c->addr, nb);
   int scope = c->scope - (c->domain == AF_INET ? 96 : 0);
-  printf("%15s/%d\n", nb, scope);
+  fprintf(user, "%15s/%d\n", nb, scope);
 }
 
 static void disp_cisco(nm_cidr *c, void *user) {
@@ -90,7 +123,7 @@ static void disp_cisco(nm_cidr *c, void *user) {
   for(i = 0; i < 16; i++) c->mask.s6.s6_addr[i] = ~c->mask.s6.s6_addr[i];
   nm_ntop(c->domain, &c->addr, nb);
   nm_ntop(c->domain, &c->mask, mb);
-  printf("%15s %-15s\n", nb, mb);
+  fprintf(user, "%15s %-15s\n", nb, mb);
 }
 
 static void range_num(char *dst, uint8_t *src) {
@@ -151,7 +184,7 @@ static void disp_range(nm_cidr *c, void *user) {
   range_num(ns, ra);
   nm_ntop(c->domain, &c->addr, nb);
   nm_ntop(c->domain, &c->mask, mb);
-  printf("%15s-%-15s (%s)\n", nb, mb, ns);
+  fprintf(user, "%15s-%-15s (%s)\n", nb, mb, ns);
 }
 
 static void num_str(char *dst, uint8_t *src, size_t len, size_t bs) {
@@ -181,7 +214,7 @@ static void disp_hex(nm_cidr *c, void *user) {
       len = c->domain == AF_INET ? 4 : 16;
   num_str(ns, c->addr.s6.s6_addr + off, len, 4);
   num_str(ms, c->mask.s6.s6_addr + off, len, 4);
-  printf("0x%s/0x%s\n", ns, ms);
+  fprintf(user, "0x%s/0x%s\n", ns, ms);
 }
 
 static void disp_octal(nm_cidr *c, void *user) {
@@ -191,7 +224,7 @@ static void disp_octal(nm_cidr *c, void *user) {
       len = c->domain == AF_INET ? 4 : 16;
   num_str(ns, c->addr.s6.s6_addr + off, len, 3);
   num_str(ms, c->mask.s6.s6_addr + off, len, 3);
-  printf("0%s/0%s\n", ns, ms);
+  fprintf(user, "0%s/0%s\n", ns, ms);
 }
 
 static void disp_binary(nm_cidr *c, void *user) {
@@ -208,50 +241,378 @@ static void disp_binary(nm_cidr *c, void *user) {
   }
   ns[9 * len - 1] = '\0';
   ms[9 * len - 1] = '\0';
-  printf("%s / %s\n", ns, ms);
+  fprintf(user, "%s / %s\n", ns, ms);
 }
 
-void display(NM nm, output_t style) {
-  nm_walk_cb disp = NULL;
-
+static nm_walk_cb disp_of(output_t style) {
   switch(style) {
-    case OUT_STD:    disp = &disp_std;    break;
-    case OUT_CIDR:   disp = &disp_cidr;   break;
-    case OUT_CISCO:  disp = &disp_cisco;  break;
-    case OUT_RANGE:  disp = &disp_range;  break;
-    case OUT_HEX:    disp = &disp_hex;    break;
-    case OUT_OCTAL:  disp = &disp_octal;  break;
-    case OUT_BINARY: disp = &disp_binary; break;
-    default: return;
+    case OUT_STD:    return &disp_std;
+    case OUT_CIDR:   return &disp_cidr;
+    case OUT_CISCO:  return &disp_cisco;
+    case OUT_RANGE:  return &disp_range;
+    case OUT_HEX:    return &disp_hex;
+    case OUT_OCTAL:  return &disp_octal;
+    case OUT_BINARY: return &disp_binary;
+    default: return NULL;
   }
-  nm_walk(nm, disp, NULL);
 }
 
-static inline int add_entry(NM *nm, const char *str, int dns) {
-  NM new = nm_new_str(str, dns);
-  if(new) {
-    *nm = nm_merge(*nm, new);
+/* --top and --diff-against output, the prefix as formatted by disp
+ * with something added */
+struct wrap {
+  nm_walk_cb disp;
+  void *out;
+};
+
+/* the weight after the prefix */
+static void disp_weighted(nm_cidr *c, void *user) {
+  struct wrap *w = user;
+  /* room for the longest style, an IPv6 prefix in binary */
+  char line[2 * 16 * 9 + 4] = "";
+  FILE *fp = fmemopen(line, sizeof(line) - 1, "w");
+
+  if(!fp) return;
+  w->disp(c, fp);
+  fclose(fp);
+  line[strcspn(line, "\n")] = '\0';
+  fprintf(w->out, "%s %" PRIu64 "\n", line, c->weight);
+}
+
+/* a mark before it, as diff -u does */
+static void disp_gone(nm_cidr *c, void *user) {
+  struct wrap *w = user;
+
+  fputc('-', w->out);
+  w->disp(c, w->out);
+}
+
+static void disp_added(nm_cidr *c, void *user) {
+  struct wrap *w = user;
+
+  fputc('+', w->out);
+  w->disp(c, w->out);
+}
+
+/* where parsed entries go: a tree, a tree that spills to disk,
+ * straight to the output for sorted input, off to a server, or into
+ * weighted heavy hitters */
+struct sink {
+  NM nm;
+  SPILL sp;
+  NM_STREAM st;
+  NM_DEDUP dd;
+  QUERY q;
+  NM_HH hh;
+  NM_BUDGET nb;
+  NM_SWEEP sw;
+  int dns;
+  /* parse errors seen, and how many of those to report */
+  size_t errors, max_errors;
+  /* input files that could not be read in full */
+  int failed;
+};
+
+/* what the command line asked to read, kept so a server can read it
+ * all again */
+struct source {
+  char **args;
+  int n, files, rflags, dedup, dns;
+  const char *fields;
+  size_t max_errors;
+  DNSCACHE dc;
+};
+
+/* out is stdout for the formatters themselves, only that can be cut up
+ * between threads */
+void display(struct sink *k, nm_walk_cb disp, void *out, int jobs) {
+  if(!disp) return;
+  if(k->sp)              spill_walk(k->sp, &k->nm, disp, out);
+  else if(out == stdout) render(k->nm, disp, stdout, jobs);
+  else                   nm_walk(k->nm, disp, out);
+}
+
+/* parse a byte count with an optional k, M or G suffix, 0 on error */
+static size_t parse_size(const char *str) {
+  char *p;
+  unsigned long long v = strtoull(str, &p, 0);
+
+  switch(*p) {
+    case 'k': case 'K': v <<= 10; p++; break;
+    case 'm': case 'M': v <<= 20; p++; break;
+    case 'g': case 'G': v <<= 30; p++; break;
+  }
+  if(*p != '\0' || *str == '-') return 0;
+  return v;
+}
+
+/* file is NULL for entries from the command line */
+static inline int add_entry(struct sink *k, const char *str,
+  uint64_t weight, const char *file, size_t line) {
+  NM new;
+  if(!k->sw)
+    new = nm_new_str(str, k->dns);
+  else if(nm_sweep_str(k->sw, str, k->dns, &new) && !new)
+    return 0; /* a range, held for the sweep */
+  if(new && k->hh) {
+    nm_hh_add(k->hh, new, weight);
+    return 0;
+  } else if(new && k->q) {
+    int bad = query_add(k->q, new);
+    nm_free(new);
+    if(bad) warn("not a single address \"%s\"", str);
+    return bad ? 1 : 0;
+  } else if(new) {
+    if(k->dd && nm_dedup_seen(k->dd, new)) {
+      nm_free(new);
+      return 0;
+    }
+    if(k->st) {
+      if(nm_stream_add(k->st, new) == 0)
+        return 0;
+      if(nm_stream_emitted(k->st)) {
+        warn("input out of order at \"%s\", retry without --sorted", str);
+        exit(1);
+      }
+      /* nothing written yet, so quietly fall back to the tree */
+      status("input out of order at \"%s\", using tree", str);
+      k->nm = nm_stream_tree(k->st);
+      k->st = NULL;
+    }
+    k->nm = nm_merge(k->nm, new);
+    if(k->nb) k->nm = nm_budget_check(k->nb, k->nm);
+    if(k->sp) k->nm = spill_check(k->sp, k->nm);
     return 0;
   } else {
-    warn("parse error \"%s\"", str);
+    if(k->errors++ >= k->max_errors)
+      return 1;
+    errno = 0; /* whatever the parser left here is not the problem */
+    if(file)
+      warn("%s:%zu: parse error \"%s\"", file, line, str);
+    else
+      warn("parse error \"%s\"", str);
+    return 1;
+  }
+}
+
+/* --top input has a spec and then optionally its weight on each line */
+static int load_weighted(struct sink *k, READER rd, const char *file) {
+  const char *word = reader_word(rd);
+  char spec[1024];
+  int rv = 0;
+
+  while(word) {
+    uint64_t weight = 1;
+    size_t line = reader_line(rd);
+    snprintf(spec, sizeof(spec), "%s", word);
+    word = reader_word(rd);
+    if(word && reader_line(rd) == line) {
+      char *p;
+      int bad;
+      errno = 0;
+      weight = strtoull(word, &p, 10);
+      bad = *p != '\0' || *word == '-' || errno;
+      if(bad && k->errors++ < k->max_errors) {
+        errno = 0;
+        warn("%s:%zu: bad weight \"%s\"", file, line, word);
+      }
+      word = reader_word(rd);
+      if(bad) {
+        rv = 1;
+        continue;
+      }
+    }
+    rv |= add_entry(k, spec, weight, file, line);
+  }
+  return rv;
+}
+
+/* feed every spec, or every word of every file, to the sink */
+static int load(struct sink *k, struct source *src) {
+  int rv = 0;
+
+  for(int i = 0; i < src->n; i++) {
+    if(src->files) {
+      const char *word;
+      READER rd = reader_open(src->args[i], src->rflags, src->fields);
+      if(!rd) {
+        fprintf(stderr, "open: %s: %s\n",
+          src->args[i], strerror(errno));
+        k->failed++;
+        continue;
+      }
+      if(k->hh)
+        rv |= load_weighted(k, rd, src->args[i]);
+      else while((word = reader_word(rd)))
+        rv |= add_entry(k, word, 1, src->args[i], reader_line(rd));
+      if(reader_close(rd) < 0) {
+        k->failed++;
+        rv = 1;
+      }
+    } else
+      rv |= add_entry(k, src->args[i], 1, NULL, 0);
+  }
+  errno = 0;
+  if(k->errors > k->max_errors)
+    warn("%zu parse errors, %zu not shown", k->errors,
+      k->errors - k->max_errors);
+  else if(k->errors)
+    status("%zu parse errors", k->errors);
+  return rv;
+}
+
+/* --tenants: each pair of words in list names an input file and the
+ * file to write the union of it and the base to.  The base is shared
+ * between them, so each costs only what its own input changes. */
+static int tenants(const char *list, struct sink *base,
+  struct source *src, nm_walk_cb disp) {
+  READER rd = reader_open(list, 0, NULL);
+  const char *word;
+  char in[1024], path[1024];
+  size_t n = 0;
+  int rv = 0;
+
+  if(!rd) {
+    fprintf(stderr, "open: %s: %s\n", list, strerror(errno));
     return 1;
   }
+  nm_share(base->nm);
+  while((word = reader_word(rd))) {
+    struct sink k = { .nm = base->nm, .dns = base->dns,
+      .max_errors = base->max_errors };
+    struct source ts = *src;
+    char *args[] = { in };
+    FILE *fp;
+
+    snprintf(in, sizeof(in), "%s", word);
+    if(!(word = reader_word(rd))) {
+      errno = 0;
+      warn("%s: no output file for \"%s\"", list, in);
+      rv = 1;
+      break;
+    }
+    snprintf(path, sizeof(path), "%s", word);
+    ts.args = args;
+    ts.n = 1;
+    ts.files = 1;
+    rv |= load(&k, &ts);
+    if(k.failed) {
+      rv = 1;
+    } else if(!(fp = fopen(path, "w"))) {
+      warn("open: %s", path);
+      rv = 1;
+    } else {
+      nm_walk(k.nm, disp, fp);
+      if(fclose(fp) != 0) {
+        warn("write: %s", path);
+        rv = 1;
+      }
+      n++;
+    }
+    if(k.nm) nm_free(k.nm);
+  }
+  if(reader_close(rd) < 0) rv = 1;
+  status("tenants: %zu sets written, %zu nodes in use", n, nm_nodes());
+  return rv;
+}
+
+/* serve_load_cb.  Entries that do not parse are skipped as they were
+ * the first time, but a file that can not be read keeps the old set. */
+static int reload(NM *nm, void *user) {
+  struct source *src = user;
+  struct sink k = { .dns = src->dns, .max_errors = src->max_errors };
+
+  for(int i = 0; src->files && i < src->n; i++) {
+    if(!strcmp(src->args[i], "-")) {
+      warn("standard input can not be read again");
+      return -1;
+    }
+  }
+  if(src->dedup) k.dd = nm_dedup_new(0);
+  load(&k, src);
+  if(k.dd) nm_dedup_free(k.dd);
+  if(src->dc) dnscache_save(src->dc);
+  if(k.failed) {
+    if(k.nm) nm_free(k.nm);
+    return -1;
+  }
+  *nm = k.nm;
+  return 0;
 }
 
 int main(int argc, char *argv[]) {
-  int optc, h = 0, v = 0, f = 0, d = 0, dns = NM_USE_DNS, lose = 0, rv = 0;
+  int optc, h = 0, v = 0, f = 0, d = 0, sorted = 0, lose = 0, rv = 0;
+  int rflags = 0, dedup = 0, sweep = 0;
   output_t output = OUT_CIDR;
+  struct sink k = { .dns = NM_USE_DNS, .max_errors = SIZE_MAX };
+  struct source src;
+  char *p, *serve_path = NULL, *query_path = NULL, *fields = NULL;
+  char *mmdb_path = NULL, *lengths = NULL, *against = NULL;
+  char *cache_path = NULL, *tenant_list = NULL, *prefix = NULL;
+  char *min = NULL, *max = NULL;
+  unsigned long ttl = 3600;
+  MMDB_WRITER mw = NULL;
+  EXPAND ex = NULL, lim = NULL;
+  DIFF df = NULL;
+  struct wrap w;
+  nm_walk_cb disp;
+  void *out = stdout;
+  long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t limit = 0, top = 0, budget = 0, shards = 0;
 
   progname = argv[0];
   initerrors(progname, 0, 0); /* stderr, nostatus */
-  while((optc = getopt_long(argc, argv, "shoxdrvbincM:m:f", longopts,
+  while((optc = getopt_long(argc, argv, "shoxdrvbincM:m:fL:SE:CDQ:q:j:J:V:B:X:K:A:N:T:U:WY:H:O:", longopts,
     (int *) NULL)) != EOF) switch(optc) {
    case 'h': h = 1;   break;
    case 'v': v++;     break;
-   case 'n': dns = 0; break;
+   case 'n': k.dns = 0; break;
    case 'f': f = 1;   break;
-//   case 'M': max = mspectou32(optarg); break;
-//   case 'm': min = mspectou32(optarg); break;
+   case 'L': if(!(limit = parse_size(optarg))) lose = 1; break;
+   case 'U': if(!(budget = parse_size(optarg))) lose = 1; break;
+   case 'S': sorted = 1; break;
+   case 'W': sweep = 1; break;
+   case 'Y': tenant_list = optarg; break;
+   case 'O': prefix = optarg; break;
+   case 'H':
+    shards = strtoul(optarg, &p, 0);
+    if(*p != '\0' || *optarg == '-' || !shards) lose = 1;
+    break;
+   case 'E':
+    k.max_errors = strtoul(optarg, &p, 0);
+    if(*p != '\0' || *optarg == '-') lose = 1;
+    break;
+   case 'C': rflags |= READER_COMMENTS; break;
+   case 'D': dedup = 1; break;
+   case 'Q': serve_path = optarg; break;
+   case 'q': query_path = optarg; break;
+   case 'B': mmdb_path = optarg; break;
+   case 'X': lengths = optarg; break;
+   case 'A': against = optarg; break;
+   case 'N': cache_path = optarg; break;
+   case 'T':
+    ttl = strtoul(optarg, &p, 0);
+    if(*p != '\0' || *optarg == '-') lose = 1;
+    break;
+   case 'K':
+    top = strtoul(optarg, &p, 0);
+    if(*p != '\0' || *optarg == '-' || !top) lose = 1;
+    break;
+   case 'J':
+    f = 1;
+    rflags = (rflags & ~READER_CSV) | READER_JSON;
+    fields = optarg;
+    break;
+   case 'V':
+    f = 1;
+    rflags = (rflags & ~READER_JSON) | READER_CSV;
+    fields = optarg;
+    break;
+   case 'j':
+    jobs = strtol(optarg, &p, 0);
+    if(*p != '\0' || jobs < 1) lose = 1;
+    break;
+   case 'M': max = optarg; break;
+   case 'm': min = optarg; break;
    case 'd':
     d = 1;
     initerrors(NULL, -1, 1); /* showstatus */
@@ -284,9 +645,42 @@ int main(int argc, char *argv[]) {
       "  -o, --octal\t\t\tOutput address/netmask pairs in octal\n"
       "  -b, --binary\t\t\tOutput address/netmask pairs in binary\n"
       "  -n, --nodns\t\t\tDisable DNS lookups for addresses\n"
-      "  -f, --files\t\t\tTreat arguments as input files\n"
-//      "  -M, --max mask\t\tLimit maximum mask size\n"
-//      "  -m, --min mask\t\tLimit minimum mask size (drop small ranges)\n"
+      "  -N, --dns-cache file\t\tKeep DNS answers in file between runs\n"
+      "  -T, --dns-ttl seconds\t\tHow long cached answers stay good,\n"
+      "\t\t\t\tan hour by default\n"
+      "  -f, --files\t\t\tTreat arguments as input files, which may\n"
+      "\t\t\t\tbe gzip or zstd compressed\n"
+      "  -L, --memory size\t\tSpill to temporary files beyond size bytes\n"
+      "  -U, --node-budget n\t\tKeep the tree under n nodes, widening\n"
+      "\t\t\t\tprefixes as little as it takes\n"
+      "  -S, --sorted\t\t\tStream input already sorted by address\n"
+      "  -W, --sweep\t\t\tJoin overlapping ranges before merging\n"
+      "  -E, --max-errors n\t\tReport at most n parse errors\n"
+      "  -C, --comments\t\tSkip #comments in input files\n"
+      "  -D, --dedup\t\t\tDrop repeated entries before merging\n"
+      "  -Q, --serve socket\t\tAnswer queries on a unix socket\n"
+      "  -q, --query socket\t\tLook addresses up with a server or in\n"
+      "\t\t\t\ta MaxMind DB file\n"
+      "  -B, --mmdb file\t\tWrite a MaxMind DB instead of a list\n"
+      "  -X, --expand len,...\t\tRewrite prefixes using only these lengths\n"
+      "  -K, --top k\t\t\tSummarize weighted input as the k prefixes\n"
+      "\t\t\t\tcarrying the most weight\n"
+      "  -A, --diff-against file	Output only the +/- lines that turn\n"
+      "\t\t\t\tthe earlier output in file into this one\n"
+      "  -Y, --tenants list\t\tWrite the union of the input and each\n"
+      "\t\t\t\tfile named in list to the file after it\n"
+      "  -H, --shards n\t\t\tWrite n files of about the same size,\n"
+      "\t\t\t\teach holding one run of addresses\n"
+      "  -O, --output-prefix prefix\tName shard files prefix followed by\n"
+      "\t\t\t\tthe shard number\n"
+      "  -j, --jobs n\t\t\tFormat output on up to n threads\n"
+      "  -J, --json field,...\t\tRead files as JSON, taking the values\n"
+      "\t\t\t\tof the named members\n"
+      "  -V, --csv column[,column]\tRead files as CSV, taking a column or\n"
+      "\t\t\t\ta range from two, by number or name\n"
+      "  -M, --max len[,len6]\t\tSplit prefixes shorter than len bits\n"
+      "  -m, --min len[,len6]\t\tLeave out prefixes longer than len bits\n"
+      "\t\t\t\tlen alone is for IPv4 up to 32, else IPv6\n"
       "Definitions:\n"
       "  a spec can be any of:\n"
       "    address\n"
@@ -302,27 +696,111 @@ int main(int argc, char *argv[]) {
       "  a mask is the number of bits set to one from the left\n", progname);
     exit(0);
   }
+  /* a server needs the whole tree in memory */
+  if(serve_path && (limit || sorted || query_path)) lose = 1;
+  if(query_path && (limit || sorted)) lose = 1;
+  if(mmdb_path && (serve_path || query_path)) lose = 1;
+  if(lengths && (serve_path || mmdb_path)) lose = 1;
+  if(top && (serve_path || query_path || mmdb_path || lengths || limit ||
+    sorted)) lose = 1;
+  if(tenant_list && (serve_path || query_path || mmdb_path || lengths ||
+    top || against || limit || budget || sorted)) lose = 1;
+  if(sweep && (serve_path || query_path || top || sorted)) lose = 1;
+  if(budget && (serve_path || query_path || top)) lose = 1;
+  if(against && (serve_path || query_path || mmdb_path || lengths || top))
+    lose = 1;
+  /* each shard is cut from the whole tree */
+  if(!shards != !prefix) lose = 1;
+  if(shards && (serve_path || query_path || mmdb_path || lengths || top ||
+    against || tenant_list || limit || sorted)) lose = 1;
+  if((min || max) && (serve_path || mmdb_path || top || against ||
+    tenant_list || shards)) lose = 1;
+  disp = disp_of(output);
+  if(lengths && disp && !(ex = expand_new(lengths, disp, stdout))) lose = 1;
+  if(ex) {
+    disp = expand_cb;
+    out = ex;
+  }
+  /* limits go on the tree's own prefixes, before any expansion */
+  if((min || max) && disp &&
+    !(lim = expand_limits(min, max, disp, out))) lose = 1;
+  if(lim) {
+    disp = expand_cb;
+    out = lim;
+  }
   if(lose || optind == argc) {
     fprintf(stderr, usage, progname);
     exit(1);
   }
-  NM nm = NULL;
-  for(;optind < argc; optind++) {
-    if(f) {
-      char buf[1024];
-      FILE *fp = strncmp(argv[optind], "-", 2) ?
-        fopen(argv[optind], "r") : stdin;
-      if(!fp) {
-        fprintf(stderr, "fopen: %s: %s\n",
-          argv[optind], strerror(errno));
-        continue;
-      }
-      while(fscanf(fp, "%1023s", buf) != EOF)
-        rv |= add_entry(&nm, buf, dns);
-    } else
-      rv |= add_entry(&nm, argv[optind], dns);
+  src = (struct source){
+    .args = argv + optind, .n = argc - optind, .files = f,
+    .rflags = rflags, .fields = fields, .dedup = dedup, .dns = k.dns,
+    .max_errors = k.max_errors,
+  };
+  if(cache_path && k.dns) {
+    if(!(src.dc = dnscache_open(cache_path, ttl))) exit(1);
+    nm_resolver(dnscache_resolve, src.dc);
+  }
+  if(against) {
+    w = (struct wrap){ disp, stdout };
+    if(!(df = diff_new(against, disp_gone, disp_added, &w))) exit(1);
+    disp = diff_cb;
+    out = df;
+  }
+  if(query_path && !(k.q = query_open(query_path, disp, out))) {
+    warn("connect: %s", query_path);
+    exit(1);
+  }
+  if(limit) k.sp = spill_new(limit);
+  if(budget) k.nb = nm_budget_new(budget);
+  if(sweep) k.sw = nm_sweep_new();
+  /* the table is not part of the tree, keep it to a share of --memory */
+  if(dedup) k.dd = nm_dedup_new(limit / 4);
+  if(top) k.hh = nm_hh_new(top);
+  if(mmdb_path) {
+    mw = mmdb_writer_new();
+    if(sorted) k.st = nm_stream_new(mmdb_add_cb, mw);
+  } else if(sorted && disp) {
+    k.st = nm_stream_new(disp, out);
+  }
+  rv |= load(&k, &src);
+  if(k.dd) nm_dedup_free(k.dd);
+  if(k.sw) {
+    k.nm = nm_sweep_end(k.sw, k.nm);
+    if(k.nb) k.nm = nm_budget_check(k.nb, k.nm);
+    if(k.sp) k.nm = spill_check(k.sp, k.nm);
+  }
+  if(k.nb) nm_budget_free(k.nb);
+  if(src.dc) dnscache_save(src.dc);
+  if(tenant_list) {
+    rv |= tenants(tenant_list, &k, &src, disp);
+    if(src.dc) dnscache_save(src.dc);
+    return(rv);
+  }
+  if(k.q) {
+    if(query_close(k.q)) rv = 1;
+    if(lim) expand_free(lim);
+    if(ex && expand_free(ex)) rv = 1;
+    return(rv);
+  }
+  if(serve_path)
+    return(serve(serve_path, k.nm, reload, &src));
+  if(k.hh) {
+    w = (struct wrap){ disp, out };
+    nm_hh_end(k.hh, disp_weighted, &w);
+  } else if(k.st) nm_stream_end(k.st);
+  else if(mw && k.sp) spill_walk(k.sp, &k.nm, mmdb_add_cb, mw);
+  else if(mw) nm_walk(k.nm, mmdb_add_cb, mw);
+  else if(shards) {
+    if(render_shards(k.nm, disp, prefix, shards, jobs < 64 ? jobs : 64))
+      rv = 1;
   }
-  display(nm, output);
-  if(d) nm_dump(nm);
+  else     display(&k, disp, out, jobs < 64 ? jobs : 64);
+  if(mw && mmdb_write(mw, mmdb_path)) rv = 1;
+  if(lim) expand_free(lim);
+  if(ex && expand_free(ex)) rv = 1;
+  if(df) diff_free(df);
+  if(d && k.nm) nm_dump(k.nm);
+  if(k.sp) spill_free(k.sp);
   return(rv);
 }
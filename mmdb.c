@@ -0,0 +1,439 @@
+/* mmdb.c - MaxMind DB output for netmask
+ *
+ * Copyright (c) 2025  Robert Stone <talby@trap.mtview.ca.us>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "errors.h"
+#include "mmdb.h"
+
+/* See https://maxmind.github.io/MaxMind-DB/ for the format.  The search
+ * tree is a binary trie with two records per node, each either another
+ * node, "no data" or a pointer into the data section that follows the
+ * tree and a 16 byte separator.  Metadata goes at the very end. */
+#define MM_EMPTY UINT32_MAX
+#define MM_DATA (UINT32_MAX - 1)
+
+static const uint8_t mm_marker[] = "\xab\xcd\xef" "MaxMind.com";
+
+/* the one data record: a boolean true */
+static const uint8_t mm_data[] = { 0x01, 0x07 };
+
+/* ::ffff:0:0/96 is where netmask keeps IPv4 and ::/96 where MMDB does */
+static const uint8_t mm_zero[16];
+static const uint8_t mm_v4[16] = { [10] = 0xff, [11] = 0xff };
+static const uint8_t mm_6to4[16] = { 0x20, 0x02 };
+
+struct mmdb_writer {
+    uint32_t (*rec)[2];
+    size_t n, cap, dropped;
+};
+
+static inline int mm_bit(const uint8_t *a, int i) {
+    return a[i >> 3] >> (7 - (i & 7)) & 1;
+}
+
+/* is a/alen inside b/blen */
+static int mm_within(const uint8_t *a, int alen, const uint8_t *b, int blen) {
+    if (alen < blen) return 0;
+    for (int i = 0; i < blen; i++)
+        if (mm_bit(a, i) != mm_bit(b, i)) return 0;
+    return 1;
+}
+
+static uint32_t mm_node(MMDB_WRITER w) {
+    if (w->n == w->cap) {
+        w->cap = w->cap ? w->cap * 2 : 1024;
+        w->rec = realloc(w->rec, w->cap * sizeof(*w->rec));
+        if (!w->rec) panic("out of memory for mmdb tree");
+    }
+    w->rec[w->n][0] = w->rec[w->n][1] = MM_EMPTY;
+    return w->n++;
+}
+
+MMDB_WRITER mmdb_writer_new(void) {
+    MMDB_WRITER w = calloc(1, sizeof(struct mmdb_writer));
+    mm_node(w); /* the root */
+    return w;
+}
+
+/* prefixes arrive disjoint, so each one just needs a path */
+static void mm_insert(MMDB_WRITER w, const uint8_t *a, int len) {
+    uint32_t node = 0;
+
+    if (len == 0) {
+        w->rec[0][0] = w->rec[0][1] = MM_DATA;
+        return;
+    }
+    for (int d = 0; d < len - 1; d++) {
+        uint32_t r = w->rec[node][mm_bit(a, d)];
+        if (r == MM_DATA) return;
+        if (r == MM_EMPTY) {
+            r = mm_node(w);
+            w->rec[node][mm_bit(a, d)] = r;
+        }
+        node = r;
+    }
+    w->rec[node][mm_bit(a, len - 1)] = MM_DATA;
+}
+
+/* move IPv4 from ::ffff:0:0/96 to ::/96, whatever netmask had in ::/96
+ * itself has to go, and anything covering either range is split up */
+static void mm_piece(MMDB_WRITER w, const uint8_t *a, int len) {
+    uint8_t b[16];
+
+    if (mm_within(a, len, mm_v4, 96)) {
+        memcpy(b, a, 16);
+        b[10] = b[11] = 0;
+        mm_insert(w, b, len);
+    } else if (mm_within(a, len, mm_zero, 96)) {
+        w->dropped++;
+    } else if (mm_within(mm_v4, 96, a, len) || mm_within(mm_zero, 96, a, len)) {
+        memcpy(b, a, 16);
+        b[len >> 3] &= ~(0x80 >> (len & 7));
+        mm_piece(w, b, len + 1);
+        b[len >> 3] |= 0x80 >> (len & 7);
+        mm_piece(w, b, len + 1);
+    } else {
+        mm_insert(w, a, len);
+    }
+}
+
+void mmdb_add_cb(nm_cidr *c, void *user) {
+    mm_piece(user, c->addr.s6.s6_addr, c->scope);
+}
+
+/* the record found by following a for len bits */
+static uint32_t mm_get(MMDB_WRITER w, const uint8_t *a, int len) {
+    uint32_t v = 0;
+    for (int d = 0; d < len && v < w->n; d++)
+        v = w->rec[v][mm_bit(a, d)];
+    return v;
+}
+
+/* point a/len at v unless something is there already */
+static void mm_alias(MMDB_WRITER w, const uint8_t *a, int len, uint32_t v) {
+    uint32_t node = 0, *slot;
+
+    if (v == MM_EMPTY) return;
+    for (int d = 0; d < len - 1; d++) {
+        uint32_t r = w->rec[node][mm_bit(a, d)];
+        if (r == MM_DATA) return;
+        if (r == MM_EMPTY) {
+            r = mm_node(w);
+            w->rec[node][mm_bit(a, d)] = r;
+        }
+        node = r;
+    }
+    slot = &w->rec[node][mm_bit(a, len - 1)];
+    if (*slot == MM_EMPTY)
+        *slot = v;
+    else
+        status("mmdb: not aliasing a range that has data of its own");
+}
+
+/* metadata encoding, just the types needed */
+static void mm_put(FILE *fp, int type, size_t size) {
+    int c = size < 29 ? size : size < 285 ? 29 : 30;
+
+    if (type > 7) {
+        putc(c, fp);
+        putc(type - 7, fp);
+    } else {
+        putc(type << 5 | c, fp);
+    }
+    /* metadata never needs the three byte form */
+    if (c == 29) {
+        putc(size - 29, fp);
+    } else if (c == 30) {
+        putc((size - 285) >> 8, fp);
+        putc((size - 285) & 0xff, fp);
+    }
+}
+
+static void mm_str(FILE *fp, const char *s) {
+    mm_put(fp, 2, strlen(s));
+    fputs(s, fp);
+}
+
+static void mm_uint(FILE *fp, int type, uint64_t v) {
+    int n = 0;
+    for (uint64_t t = v; t; t >>= 8) n++;
+    mm_put(fp, type, n);
+    while (n--) putc(v >> (8 * n) & 0xff, fp);
+}
+
+static void mm_record(uint8_t *p, int size, uint32_t l, uint32_t r) {
+    switch (size) {
+        case 24:
+            p[0] = l >> 16; p[1] = l >> 8; p[2] = l;
+            p[3] = r >> 16; p[4] = r >> 8; p[5] = r;
+            break;
+        case 28:
+            p[0] = l >> 16; p[1] = l >> 8; p[2] = l;
+            p[3] = (l >> 24 & 0xf) << 4 | (r >> 24 & 0xf);
+            p[4] = r >> 16; p[5] = r >> 8; p[6] = r;
+            break;
+        case 32:
+            p[0] = l >> 24; p[1] = l >> 16; p[2] = l >> 8; p[3] = l;
+            p[4] = r >> 24; p[5] = r >> 16; p[6] = r >> 8; p[7] = r;
+            break;
+    }
+}
+
+int mmdb_write(MMDB_WRITER w, const char *path) {
+    uint32_t v4 = mm_get(w, mm_zero, 96);
+    uint64_t nodes, top, epoch;
+    uint8_t rec[8];
+    const char *sde = getenv("SOURCE_DATE_EPOCH");
+    int size, rv = 0;
+    FILE *fp;
+
+    mm_alias(w, mm_v4, 96, v4);
+    mm_alias(w, mm_6to4, 16, v4);
+    if (w->dropped)
+        warn("mmdb: dropped %zu prefixes inside ::/96, which is IPv4 there",
+            w->dropped);
+    nodes = w->n;
+    top = nodes + 16 + sizeof(mm_data);
+    size = top < (1ULL << 24) ? 24 : top < (1ULL << 28) ? 28 : 32;
+    if (top >= (1ULL << 32)) {
+        warn("mmdb: %" PRIu64 " nodes is too many", nodes);
+        rv = -1;
+    } else if (!(fp = fopen(path, "wb"))) {
+        warn("mmdb: %s", path);
+        rv = -1;
+    } else {
+        for (size_t i = 0; i < w->n; i++) {
+            uint32_t v[2];
+            for (int j = 0; j < 2; j++) {
+                uint32_t r = w->rec[i][j];
+                v[j] = r == MM_EMPTY ? nodes : r == MM_DATA ? nodes + 16 : r;
+            }
+            mm_record(rec, size, v[0], v[1]);
+            fwrite(rec, 1, size / 4, fp);
+        }
+        for (int i = 0; i < 16; i++) putc(0, fp);
+        fwrite(mm_data, 1, sizeof(mm_data), fp);
+
+        /* builds are reproducible given SOURCE_DATE_EPOCH */
+        epoch = sde ? strtoull(sde, NULL, 10) : (uint64_t)time(NULL);
+        fwrite(mm_marker, 1, sizeof(mm_marker) - 1, fp);
+        mm_put(fp, 7, 9);
+        mm_str(fp, "binary_format_major_version"); mm_uint(fp, 5, 2);
+        mm_str(fp, "binary_format_minor_version"); mm_uint(fp, 5, 0);
+        mm_str(fp, "build_epoch");                 mm_uint(fp, 9, epoch);
+        mm_str(fp, "database_type");               mm_str(fp, "netmask");
+        mm_str(fp, "description");
+        mm_put(fp, 7, 1);
+        mm_str(fp, "en"); mm_str(fp, "networks aggregated by netmask");
+        mm_str(fp, "ip_version");                  mm_uint(fp, 5, 6);
+        mm_str(fp, "languages");                   mm_put(fp, 11, 0);
+        mm_str(fp, "node_count");                  mm_uint(fp, 6, nodes);
+        mm_str(fp, "record_size");                 mm_uint(fp, 5, size);
+        if (ferror(fp) | fclose(fp)) {
+            warn("mmdb: %s", path);
+            rv = -1;
+        }
+        status("mmdb: %" PRIu64 " nodes of %d bit records", nodes, size);
+    }
+    free(w->rec);
+    free(w);
+    return rv;
+}
+
+/* the reader */
+struct mmdb {
+    const uint8_t *map;
+    size_t len;
+    uint32_t nodes;
+    int size, bits;
+};
+
+/* decode a control byte, leaving *p at the payload.  0 on success. */
+static int mm_ctrl(const uint8_t **p, const uint8_t *end, int *type,
+        size_t *size) {
+    const uint8_t *q = *p;
+    int c;
+
+    if (q >= end) return -1;
+    c = *q++;
+    *type = c >> 5;
+    *size = c & 31;
+    if (*type == 0) {
+        if (q >= end) return -1;
+        *type = 7 + *q++;
+    }
+    if (*type == 1) {
+        /* pointers keep their length in the size bits */
+        *size = ((c >> 3) & 3) + 1;
+    } else if (*size >= 29) {
+        int n = *size - 28;
+        size_t base = n == 1 ? 29 : n == 2 ? 285 : 65821;
+        if (end - q < n) return -1;
+        for (*size = 0; n--;)
+            *size = *size << 8 | *q++;
+        *size += base;
+    }
+    *p = q;
+    return 0;
+}
+
+static int mm_skip(const uint8_t **p, const uint8_t *end, int depth) {
+    int type;
+    size_t size;
+
+    if (depth > 32 || mm_ctrl(p, end, &type, &size)) return -1;
+    switch (type) {
+        case 7: size *= 2; /* fall through, maps are key value pairs */
+        case 11:
+            while (size--)
+                if (mm_skip(p, end, depth + 1)) return -1;
+            return 0;
+        case 14:
+            return 0;
+    }
+    if ((size_t)(end - *p) < size) return -1;
+    *p += size;
+    return 0;
+}
+
+MMDB mmdb_open(const char *path) {
+    struct stat st;
+    const uint8_t *map, *p, *end, *meta = NULL;
+    int fd = open(path, O_RDONLY);
+    MMDB db;
+
+    if (fd < 0) return NULL;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(mm_marker)) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+    db = calloc(1, sizeof(struct mmdb));
+    db->map = map;
+    db->len = st.st_size;
+
+    /* the last marker in the file starts the metadata */
+    end = map + st.st_size;
+    for (p = end - (sizeof(mm_marker) - 1); p >= map; p--) {
+        if (!memcmp(p, mm_marker, sizeof(mm_marker) - 1)) {
+            meta = p + sizeof(mm_marker) - 1;
+            break;
+        }
+    }
+    if (meta) {
+        int type;
+        size_t pairs;
+        if (mm_ctrl(&meta, end, &type, &pairs) || type != 7)
+            meta = NULL;
+        while (meta && pairs--) {
+            size_t klen, vlen;
+            const char *key;
+            int vtype;
+            uint64_t v = 0;
+            if (mm_ctrl(&meta, end, &type, &klen) || type != 2 ||
+                    (size_t)(end - meta) < klen) {
+                meta = NULL;
+                break;
+            }
+            key = (const char *)meta;
+            meta += klen;
+            p = meta;
+            if (mm_ctrl(&p, end, &vtype, &vlen)) {
+                meta = NULL;
+                break;
+            }
+            if ((vtype == 5 || vtype == 6 || vtype == 9) && vlen <= 8 &&
+                    (size_t)(end - p) >= vlen)
+                for (size_t i = 0; i < vlen; i++) v = v << 8 | p[i];
+            if (klen == 10 && !memcmp(key, "node_count", 10))
+                db->nodes = v;
+            else if (klen == 11 && !memcmp(key, "record_size", 11))
+                db->size = v;
+            else if (klen == 10 && !memcmp(key, "ip_version", 10))
+                db->bits = v == 6 ? 128 : 32;
+            if (mm_skip(&meta, end, 0))
+                meta = NULL;
+        }
+    }
+    if (!meta || (db->size != 24 && db->size != 28 && db->size != 32) ||
+            !db->bits || (uint64_t)db->nodes * db->size / 4 > db->len) {
+        mmdb_close(db);
+        errno = EINVAL;
+        return NULL;
+    }
+    return db;
+}
+
+static uint32_t mm_read(MMDB db, uint32_t node, int bit) {
+    const uint8_t *p = db->map + (size_t)node * db->size / 4;
+    switch (db->size) {
+        case 24:
+            p += 3 * bit;
+            return p[0] << 16 | p[1] << 8 | p[2];
+        case 28:
+            if (bit)
+                return (p[3] & 0xf) << 24 | p[4] << 16 | p[5] << 8 | p[6];
+            return (uint32_t)(p[3] >> 4) << 24 | p[0] << 16 | p[1] << 8 | p[2];
+        default:
+            p += 4 * bit;
+            return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+    }
+}
+
+int mmdb_lookup(MMDB db, struct in6_addr *s6, nm_walk_cb cb, void *user) {
+    const uint8_t *a = s6->s6_addr;
+    int skip = 0, d;
+    uint32_t node = 0;
+
+    if (db->bits == 32) {
+        /* an IPv4 only database can only answer for IPv4 */
+        if (!mm_within(a, 128, mm_v4, 96)) return 0;
+        skip = 96;
+    }
+    for (d = skip; d < 128 && node < db->nodes; d++)
+        node = mm_read(db, node, mm_bit(a, d));
+    if (node <= db->nodes) return 0;
+
+    nm_cidr c = { .scope = d };
+    for (int i = 0; i < 16; i++) {
+        int bits = d - 8 * i;
+        c.mask.s6.s6_addr[i] = bits >= 8 ? 0xff : bits > 0 ? 0xff << (8 - bits) : 0;
+        c.addr.s6.s6_addr[i] = a[i] & c.mask.s6.s6_addr[i];
+    }
+    c.domain = d >= 96 && mm_within(a, 128, mm_v4, 96) ? AF_INET : AF_INET6;
+    cb(&c, user);
+    return 1;
+}
+
+void mmdb_close(MMDB db) {
+    munmap((void *)db->map, db->len);
+    free(db);
+}
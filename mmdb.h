@@ -0,0 +1,49 @@
+/* mmdb.h - MaxMind DB output for netmask
+ *
+ * Copyright (c) 2025  Robert Stone <talby@trap.mtview.ca.us>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+#ifndef _HAVE_MMDB_H
+#define _HAVE_MMDB_H
+
+#include "netmask.h"
+
+/* Builds an IPv6 MaxMind DB search tree from prefixes handed to
+ * mmdb_add_cb() as a walk callback, with the writer as user data.
+ * Every prefix points at the same data record, a boolean true.  IPv4
+ * lives at ::/96 as MMDB readers expect, and ::ffff:0:0/96 and the
+ * 6to4 range 2002::/16 are aliased to it.  mmdb_write() saves the
+ * database and frees the writer, returning -1 after warning if the file
+ * could not be written. */
+typedef struct mmdb_writer *MMDB_WRITER;
+
+MMDB_WRITER mmdb_writer_new(void);
+
+void mmdb_add_cb(nm_cidr *, void *writer);
+
+int mmdb_write(MMDB_WRITER, const char *path);
+
+/* a minimal reader, enough to check what was written.  mmdb_lookup()
+ * works like nm_lookup(), handing the network an address was found in
+ * to the callback. */
+typedef struct mmdb *MMDB;
+
+MMDB mmdb_open(const char *path);
+
+int mmdb_lookup(MMDB, struct in6_addr *, nm_walk_cb, void *);
+
+void mmdb_close(MMDB);
+#endif
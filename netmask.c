@@ -17,35 +17,89 @@
    along with this program; if not, write to the Free Software
    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
 
+#include <errno.h>
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <arpa/inet.h>
 
+#include "config.h"
 #include "errors.h"
 #include "netmask.h"
 #include "u128.h"
 
 #define PRIx128 "%016" PRIx64 "%016" PRIx64
-#define PRMu128(x) (x).h, (x).l
+#define PRMu128(x) u128_hi(x), u128_lo(x)
 
 struct nm {
     u128_t neta;
     uint8_t len;
+    uint8_t bits; /* heads a struct nm_bits */
+    uint8_t weighted; /* heads a struct nm_weighted */
+    uint8_t shared; /* frozen by nm_share() */
     int domain;
     NM l, r;
 };
 
+/* Dense regions.  A /120 holding a few prefixes keeps them as a bitmap
+ * of its 256 addresses rather than as a subtree, once that is smaller
+ * than the subtree would be, and far smaller as it fills up.  A second
+ * bitmap marks addresses covered by input written
+ * as IPv6, so that prefixes read back out get the domain they would
+ * have had as leaves.  A region is never empty, and once full it turns
+ * back into a leaf. */
+#define NM_BITS_LEN 120
+#define NM_BITS_WORDS 4
+
+struct nm_bits {
+    struct nm node;
+    uint64_t set[NM_BITS_WORDS], v6[NM_BITS_WORDS];
+};
+
+/* a prefix in a heavy hitter tree, see nm_hh_add() */
+struct nm_weighted {
+    struct nm node;
+    uint64_t weight;
+};
+
+/* a region's share of nm_nodes(), by size */
+#define NM_BITS_WEIGHT \
+    ((sizeof(struct nm_bits) + sizeof(struct nm) - 1) / sizeof(struct nm))
+
+/* k prefixes take 2k - 1 nodes as a subtree, so this is the fewest a
+ * region can hold before the bitmap is the smaller of the two */
+#define NM_BITS_MIN ((NM_BITS_WEIGHT + 1) / 2 + 1)
+
+/* count of live nodes across all trees, so callers can keep an eye on
+ * memory use while ingesting */
+static size_t nm_live = 0;
+
+size_t nm_nodes(void) {
+    return nm_live;
+}
+
+size_t nm_node_size(void) {
+    return sizeof(struct nm);
+}
+
 NM nm_new_u128(u128_t neta, uint8_t len, uint8_t domain) {
     if (len > 128) return NULL;
     NM self = (NM)calloc(1, sizeof(struct nm));
     self->neta = u128_and(neta, u128_mask(len));
     self->len = len;
     self->domain = domain;
+    nm_live++;
     return self;
 }
 
+/* shared nodes may belong to any number of trees, so they stay */
+static inline void nm_del(NM self) {
+    if (self->shared) return;
+    nm_live -= self->bits ? NM_BITS_WEIGHT : 1;
+    free(self);
+}
+
 NM nm_new_v4(struct in_addr *s) {
     return nm_new_u128(u128_of_v4(s), 128, AF_INET);
 }
@@ -57,19 +111,162 @@ NM nm_new_v6(struct in6_addr *s6) {
 /* this is slightly complicated because an NM can outgrow it's initial
  * v4 state, but if it doesn't, we want to retain the fact that it
  * was and remained v4.  */
-static inline int is_v4(NM self) {
-    return self->domain == AF_INET && 0 == u128_cmp(
+static inline int is_v4_u128(u128_t neta, int domain) {
+    return domain == AF_INET && 0 == u128_cmp(
         u128(0, 0x0000ffff00000000ULL),
-        u128_and(self->neta, u128_mask(96))
+        u128_and(neta, u128_mask(96))
     );
 }
 
+static inline int is_v4(NM self) {
+    return is_v4_u128(self->neta, self->domain);
+}
+
 static inline int is_leaf(NM self) {
-    return !self->l && !self->r;
+    return !self->l && !self->r && !self->bits;
+}
+
+/* internal nodes always have both children */
+static inline int is_inner(NM self) {
+    return self->l != NULL;
+}
+
+static inline int domain_and(int a, int b) {
+    return a == AF_INET && b == AF_INET ? AF_INET : AF_INET6;
 }
 
 static inline int domain_merge(NM a, NM b) {
-    return a->domain == AF_INET && b->domain == AF_INET ? AF_INET : AF_INET6;
+    return domain_and(a->domain, b->domain);
+}
+
+static inline uint64_t *weight_of(NM self) {
+    return &((struct nm_weighted *)self)->weight;
+}
+
+static NM weighted_new(u128_t neta, uint8_t len, int domain,
+        uint64_t weight) {
+    struct nm_weighted *w = calloc(1, sizeof(struct nm_weighted));
+    w->node.neta = u128_and(neta, u128_mask(len));
+    w->node.len = len;
+    w->node.weighted = 1;
+    w->node.domain = domain;
+    w->weight = weight;
+    nm_live++;
+    return &w->node;
+}
+
+static inline struct nm_bits *bits_of(NM self) {
+    return (struct nm_bits *)self;
+}
+
+static struct nm_bits *bits_new(u128_t neta, int domain) {
+    struct nm_bits *b = calloc(1, sizeof(struct nm_bits));
+    b->node.neta = u128_and(neta, u128_mask(NM_BITS_LEN));
+    b->node.len = NM_BITS_LEN;
+    b->node.bits = 1;
+    b->node.domain = domain;
+    nm_live += NM_BITS_WEIGHT;
+    return b;
+}
+
+/* n bits from i, where n is a power of two and i a multiple of it */
+static inline void bits_fill(uint64_t *w, int i, int n) {
+    if (n >= 64)
+        for (int j = i >> 6; j < (i + n) >> 6; j++) w[j] = ~0ULL;
+    else
+        w[i >> 6] |= ((1ULL << n) - 1) << (i & 63);
+}
+
+static inline int bits_any(const uint64_t *w, int i, int n) {
+    if (n >= 64) {
+        for (int j = i >> 6; j < (i + n) >> 6; j++)
+            if (w[j]) return 1;
+        return 0;
+    }
+    return (w[i >> 6] >> (i & 63) & ((1ULL << n) - 1)) != 0;
+}
+
+static inline int bits_all(const uint64_t *w, int i, int n) {
+    if (n >= 64) {
+        for (int j = i >> 6; j < (i + n) >> 6; j++)
+            if (~w[j]) return 0;
+        return 1;
+    }
+    return (~w[i >> 6] >> (i & 63) & ((1ULL << n) - 1)) == 0;
+}
+
+/* the first bit from i on that differs from flip, 256 if none */
+static inline int bits_scan(const uint64_t *w, int i, uint64_t flip) {
+    for (int j = i >> 6; j < NM_BITS_WORDS; j++) {
+        uint64_t v = w[j] ^ flip;
+        if (j == i >> 6) v &= ~0ULL << (i & 63);
+        if (v) return 64 * j + u64_ctz(v);
+    }
+    return 256;
+}
+
+/* The next prefix from *pos on, as an offset returned and a size of
+ * 2^k, or -1 when there are no more.  Each run of set bits comes out
+ * as the largest aligned blocks that fit, which is what the tree would
+ * have aggregated it to. */
+static inline int bits_next(struct nm_bits *b, int *pos, int *k) {
+    int i = bits_scan(b->set, *pos, 0), end;
+
+    if (i == 256) return -1;
+    end = bits_scan(b->set, i, ~0ULL);
+    *k = 63 - u64_clz(end - i);
+    if (i && u64_ctz(i) < *k) *k = u64_ctz(i);
+    *pos = i + (1 << *k);
+    return i;
+}
+
+static inline u128_t bits_addr(struct nm_bits *b, int i) {
+    return u128_or(b->node.neta, u128(0, i));
+}
+
+static inline int bits_domain(struct nm_bits *b, int i, int k) {
+    return bits_any(b->v6, i, 1 << k) ? AF_INET6 : AF_INET;
+}
+
+/* move a subtree that lies inside the region into it */
+static void bits_absorb(struct nm_bits *b, NM self) {
+    b->node.domain = domain_merge(&b->node, self);
+    if (self->bits) {
+        struct nm_bits *o = bits_of(self);
+        for (int j = 0; j < NM_BITS_WORDS; j++) {
+            b->set[j] |= o->set[j];
+            b->v6[j] |= o->v6[j];
+        }
+    } else if (is_leaf(self)) {
+        int i = u128_lo(self->neta) & 0xff, n = 1 << (128 - self->len);
+        bits_fill(b->set, i, n);
+        if (self->domain != AF_INET) bits_fill(b->v6, i, n);
+    } else {
+        bits_absorb(b, self->l);
+        bits_absorb(b, self->r);
+    }
+    nm_del(self);
+}
+
+/* prefixes in a subtree inside a region, counting no further than max */
+static size_t bits_count(NM self, size_t max) {
+    size_t n;
+
+    if (self->bits) return max;
+    if (is_leaf(self)) return 1;
+    n = bits_count(self->l, max);
+    if (n < max) n += bits_count(self->r, max - n);
+    return n;
+}
+
+/* a full region is just a leaf */
+static NM bits_done(struct nm_bits *b) {
+    NM self;
+
+    if (!bits_all(b->set, 0, 256)) return &b->node;
+    self = nm_new_u128(b->node.neta, NM_BITS_LEN, b->node.domain);
+    nm_del(&b->node);
+    return self;
 }
 
 NM nm_new_ai(struct addrinfo *ai) {
@@ -96,6 +293,14 @@ NM nm_new_ai(struct addrinfo *ai) {
     return self;
 }
 
+static nm_resolve_cb resolve_cb;
+static void *resolve_user;
+
+void nm_resolver(nm_resolve_cb cb, void *user) {
+    resolve_cb = cb;
+    resolve_user = user;
+}
+
 static inline NM parse_addr(const char *str, int flags) {
     struct in6_addr s6;
     struct in_addr s;
@@ -106,7 +311,9 @@ static inline NM parse_addr(const char *str, int flags) {
     if(inet_aton(str, &s))
         return nm_new_v4(&s);
 
-    if(NM_USE_DNS & flags) {
+    if(NM_USE_DNS & flags && resolve_cb) {
+        return resolve_cb(str, resolve_user);
+    } else if(NM_USE_DNS & flags) {
         struct addrinfo in, *out;
 
         memset(&in, 0, sizeof(struct addrinfo));
@@ -155,39 +362,51 @@ static inline int parse_mask(NM self, const char *str, int flags) {
     return 1;
 }
 
-/* turn a pair into a range (inclusive), both of these should be
- * freshly created leaf nodes */
-static inline NM nm_seq(NM min, NM max) {
-    if (u128_cmp(min->neta, max->neta) > 0) {
-        NM tmp = max;
-        max = min;
-        min = tmp;
-    }
-    int domain = domain_merge(min, max);
-    NM rv = NULL;
-
-    u128_t cur = min->neta;
+/* merge the prefixes making up an inclusive range into rv */
+static NM seq_merge(NM rv, u128_t min, u128_t max, int domain) {
+    u128_t cur = min;
     u128_t one = u128(0, 1);
-    while (u128_cmp(cur, max->neta) <= 0) {
+    while (u128_cmp(cur, max) <= 0) {
         uint8_t len = 128;
         while (len > 0) {
             u128_t mask = u128_mask(len - 1);
             u128_t lo = u128_and(cur, mask);
-            if (u128_cmp(min->neta, lo) > 0) break;
+            if (u128_cmp(min, lo) > 0) break;
             u128_t hi = u128_or(cur, u128_not(mask));
-            if (u128_cmp(hi, max->neta) > 0) break;
+            if (u128_cmp(hi, max) > 0) break;
             len--;
         }
         rv = nm_merge(rv, nm_new_u128(cur, len, domain));
         u128_t hi = u128_or(cur, u128_not(u128_mask(len)));
-        cur = u128_add(hi, one, NULL);
+        int carry;
+        cur = u128_add(hi, one, &carry);
+        if (carry) break; /* the range ran to the last address */
     }
-    free(min);
-    free(max);
     return rv;
 }
 
-NM nm_new_str(const char *str, int flags) {
+/* put the ends of a range in order */
+static inline void seq_order(NM *min, NM *max) {
+    if (u128_cmp((*min)->neta, (*max)->neta) > 0) {
+        NM tmp = *max;
+        *max = *min;
+        *min = tmp;
+    }
+}
+
+/* turn a pair into a range (inclusive), both of these should be
+ * freshly created leaf nodes */
+static inline NM nm_seq(NM min, NM max) {
+    seq_order(&min, &max);
+    NM rv = seq_merge(NULL, min->neta, max->neta, domain_merge(min, max));
+    nm_del(min);
+    nm_del(max);
+    return rv;
+}
+
+/* parse a spec.  A range comes back as its two ends, the second in
+ * *end, for the caller to fill in. */
+static NM parse_spec(const char *str, int flags, NM *end) {
     char *p, buf[2048];
     NM self;
 
@@ -198,7 +417,7 @@ NM nm_new_str(const char *str, int flags) {
         if(!self)
             return NULL;
         if(!parse_mask(self, p + 1, flags)) {
-            free(self);
+            nm_del(self);
             return NULL;
         }
         return self;
@@ -217,21 +436,22 @@ NM nm_new_str(const char *str, int flags) {
             add = 0;
         top = parse_addr(p + add + 1, flags);
         if(!top) {
-            free(self);
+            nm_del(self);
             return NULL;
         }
         if(add) {
             int carry;
             if(is_v4(top))
-                top->neta.l &= 0xffffffffULL;
+                top->neta = u128_and(top->neta, u128(0, 0xffffffffULL));
             top->neta = u128_add(self->neta, top->neta, &carry);
             if(carry) {
-                free(self);
-                free(top);
+                nm_del(self);
+                nm_del(top);
                 return NULL;
             }
         }
-        return nm_seq(self, top);
+        *end = top;
+        return self;
     } else if((self = parse_addr(str, flags))) {
         return self;
     } else if((p = strchr(str, ':'))) { /* old range character (sloppy) */
@@ -252,15 +472,16 @@ NM nm_new_str(const char *str, int flags) {
                  * overflow and things just happened to work out. */
                 struct in_addr s;
                 char *endp;
-                uint32_t v = self->neta.l + strtoul(p + 2, &endp, 0);
+                uint32_t v = u128_lo(self->neta) + strtoul(p + 2, &endp, 0);
                 if(*endp == '\0') {
                     s.s_addr = htonl(v);
                     top = nm_new_v4(&s);
                     if(!top) {
-                        free(self);
+                        nm_del(self);
                         return NULL;
                     }
-                    return nm_seq(self, top);
+                    *end = top;
+                    return self;
                 }
             }
         } else {
@@ -269,37 +490,79 @@ NM nm_new_str(const char *str, int flags) {
 
         top = parse_addr(p + add + 1, flags);
         if(!top) {
-            free(self);
+            nm_del(self);
             return NULL;
         }
         if(add) {
             int carry;
             if(is_v4(top))
-                top->neta.l &= 0xffffffffULL;
+                top->neta = u128_and(top->neta, u128(0, 0xffffffffULL));
             top->neta = u128_add(self->neta, top->neta, &carry);
             if(carry) {
-                free(self);
-                free(top);
+                nm_del(self);
+                nm_del(top);
                 return NULL;
             }
         }
-        return nm_seq(self, top);
+        *end = top;
+        return self;
     } else {
         return NULL;
     }
 }
 
+NM nm_new_str(const char *str, int flags) {
+    NM end = NULL, self = parse_spec(str, flags, &end);
+    return self && end ? nm_seq(self, end) : self;
+}
+
 void nm_free(NM self) {
+    if (self->shared) return;
     if (self->l) nm_free(self->l);
     if (self->r) nm_free(self->r);
-    free(self);
+    nm_del(self);
 }
 
+/* Persistent trees.  A merge only changes nodes along the paths it
+ * takes, which nm_own() copies first if they are shared.  The copy
+ * still points at the shared children, which are copied in turn if the
+ * merge goes on down into them.  Merges that just link a shared subtree
+ * in, or would free one, leave it be. */
+void nm_share(NM self) {
+    if (!self || self->shared) return;
+    self->shared = 1;
+    nm_share(self->l);
+    nm_share(self->r);
+}
+
+static inline NM nm_own(NM self) {
+    size_t size;
+    NM c;
+
+    if (!self->shared) return self;
+    size = self->bits ? sizeof(struct nm_bits) :
+        self->weighted ? sizeof(struct nm_weighted) : sizeof(struct nm);
+    c = malloc(size);
+    memcpy(c, self, size);
+    c->shared = 0;
+    nm_live += c->bits ? NM_BITS_WEIGHT : 1;
+    return c;
+}
+
+/* a weighted merge keeps every prefix it is given as a node of its own,
+ * adding up the weights of equal ones, rather than building the union */
 typedef struct merge_ctx {
   NM (*call)(struct merge_ctx *, NM, NM);
+  int weighted;
 } *merge_ctx;
 
 static inline NM merge_split(merge_ctx ctx, NM a, NM b, uint8_t len) {
+    if (ctx->weighted) {
+        NM c = weighted_new(a->neta, len, domain_merge(a, b), 0);
+        c->l = u128_bit(b->neta, len) ? a : b;
+        c->r = u128_bit(b->neta, len) ? b : a;
+        return c;
+    }
     NM c = nm_new_u128(a->neta, len, domain_merge(a, b));
     if(u128_bit(b->neta, len)) {
         c->l = a;
@@ -311,13 +574,21 @@ static inline NM merge_split(merge_ctx ctx, NM a, NM b, uint8_t len) {
     return c;
 }
 
+/* a node's domain is kept as the union of the domains of everything
+ * ever merged under it, so the result does not depend on input order */
 static inline NM merge_child(merge_ctx ctx, NM a, NM b) {
-    if (is_leaf(a))
+    a = nm_own(a);
+    a->domain = domain_merge(a, b);
+    if (is_leaf(a) && !ctx->weighted) {
         nm_free(b);
-    else if (u128_bit(b->neta, a->len))
+    } else if (a->bits) {
+        bits_absorb(bits_of(a), b);
+        return bits_done(bits_of(a));
+    } else if (u128_bit(b->neta, a->len)) {
         a->r = ctx->call(ctx, a->r, b);
-    else
+    } else {
         a->l = ctx->call(ctx, a->l, b);
+    }
     return a;
 }
 
@@ -326,18 +597,25 @@ static inline NM merge_pivot(merge_ctx ctx, NM a, NM b) {
 }
 
 static inline NM merge_merge(merge_ctx ctx, NM a, NM b) {
-    if (is_leaf(a)) {
+    a = nm_own(a);
+    b = nm_own(b);
+    a->domain = b->domain = domain_merge(a, b);
+    if (ctx->weighted) {
+        *weight_of(a) += *weight_of(b);
+    } else if (is_leaf(a)) {
         nm_free(b);
         return a;
-    }
-    if (is_leaf(b)) {
+    } else if (is_leaf(b)) {
         nm_free(a);
         return b;
+    } else if (a->bits || b->bits) {
+        struct nm_bits *bits = bits_of(a->bits ? a : b);
+        bits_absorb(bits, a->bits ? b : a);
+        return bits_done(bits);
     }
-    a->domain = domain_merge(a, b);
     a->l = ctx->call(ctx, a->l, b->l);
     a->r = ctx->call(ctx, a->r, b->r);
-    free(b);
+    nm_del(b);
     return a;
 }
 
@@ -355,13 +633,24 @@ static inline NM merge_step(merge_ctx ctx, NM a, NM b) {
     else /* if (a->len == b->len) */
         c = merge_merge(ctx, a, b);
     /* check for aggregates */
-    if (c->l && is_leaf(c->l) && c->l->len == c->len + 1 &&
+    if (!ctx->weighted &&
+        c->l && is_leaf(c->l) && c->l->len == c->len + 1 &&
         c->r && is_leaf(c->r) && c->r->len == c->len + 1) {
-        free(c->l);
-        free(c->r);
+        nm_del(c->l);
+        nm_del(c->r);
         c->l = NULL;
         c->r = NULL;
     }
+    /* a subtree inside a region turns into a bitmap once that is
+     * smaller.  One nested in a larger subtree in the same region may
+     * briefly sit below it as a bitmap, until the caller's step here
+     * absorbs it in turn. */
+    if (!ctx->weighted && c->len >= NM_BITS_LEN && !c->bits &&
+            bits_count(c, NM_BITS_MIN) >= NM_BITS_MIN) {
+        struct nm_bits *bits = bits_new(c->neta, c->domain);
+        bits_absorb(bits, c);
+        return bits_done(bits);
+    }
     return c;
 }
 
@@ -434,9 +723,16 @@ static const char *nm_dump_lf = "╴"; /* at leaf node */
 static inline void nm_dump_print(NM nm, const char *pre[], size_t len) {
     char line[168], *p = line, ls[4];
     for(size_t i = 0; i < len; i++) p = stpcpy(p, pre[i]);
-    p = stpcpy(p, is_leaf(nm) ? nm_dump_lf : nm_dump_pr);
+    p = stpcpy(p, is_inner(nm) ? nm_dump_pr : nm_dump_lf);
     snprintf(ls, 4, "%-3d", nm->len);
-    status(PRIx128 "/%s %s", PRMu128(nm->neta), ls, line);
+    if (nm->bits) {
+        int n = 0;
+        for (int j = 0; j < NM_BITS_WORDS; j++)
+            n += u64_popc(bits_of(nm)->set[j]);
+        status(PRIx128 "/%s %s %d addresses", PRMu128(nm->neta), ls, line, n);
+    } else {
+        status(PRIx128 "/%s %s", PRMu128(nm->neta), ls, line);
+    }
 }
 
 static inline void nm_dump_node(NM nm, const char *pre[], size_t len) {
@@ -456,17 +752,941 @@ void nm_dump(NM nm) {
 }
 /* LCOV_EXCL_STOP */
 
+static inline void cidr_set(nm_cidr *c, u128_t neta, uint8_t len,
+        int domain) {
+    *c = (nm_cidr){
+        .domain = is_v4_u128(neta, domain) ? AF_INET : AF_INET6,
+        .addr = { .s6 = v6_of_u128(neta) },
+        .mask = { .s6 = v6_of_u128(u128_mask(len)) },
+        .scope = len,
+    };
+}
+
+static inline void nm_emit(u128_t neta, uint8_t len, int domain,
+        nm_walk_cb cb, void *user) {
+    nm_cidr cidr;
+    cidr_set(&cidr, neta, len, domain);
+    cb(&cidr, user);
+}
+
+static void bits_walk(struct nm_bits *b, nm_walk_cb cb, void *user) {
+    for (int pos = 0, i, k; (i = bits_next(b, &pos, &k)) >= 0;)
+        nm_emit(bits_addr(b, i), 128 - k, bits_domain(b, i, k), cb, user);
+}
+
 void nm_walk(NM self, nm_walk_cb cb, void *user) {
     if (!self) return;
     nm_walk(self->l, cb, user);
-    if (is_leaf(self)) {
+    if (self->bits)
+        bits_walk(bits_of(self), cb, user);
+    else if (is_leaf(self))
+        nm_emit(self->neta, self->len, self->domain, cb, user);
+    nm_walk(self->r, cb, user);
+}
+
+/* every level down pushes two nodes and pops one */
+#define NM_ITER_DEPTH 130
+
+struct nm_iter {
+    NM stk[NM_ITER_DEPTH];
+    size_t n;
+    struct nm_bits *bits;
+    int pos;
+};
+
+NM_ITER nm_iter_new(NM self) {
+    NM_ITER it = calloc(1, sizeof(struct nm_iter));
+    if (self) it->stk[it->n++] = self;
+    return it;
+}
+
+int nm_iter_next(NM_ITER it, nm_cidr *c) {
+    for (;;) {
+        NM self;
+        if (it->bits) {
+            int i, k;
+            if ((i = bits_next(it->bits, &it->pos, &k)) >= 0) {
+                cidr_set(c, bits_addr(it->bits, i), 128 - k,
+                        bits_domain(it->bits, i, k));
+                return 1;
+            }
+            it->bits = NULL;
+        }
+        if (!it->n) return 0;
+        self = it->stk[--it->n];
+        if (is_inner(self)) {
+            it->stk[it->n++] = self->r;
+            it->stk[it->n++] = self->l;
+        } else if (self->bits) {
+            it->bits = bits_of(self);
+            it->pos = 0;
+        } else {
+            cidr_set(c, self->neta, self->len, self->domain);
+            return 1;
+        }
+    }
+}
+
+void nm_iter_free(NM_ITER it) {
+    free(it);
+}
+
+size_t nm_leaves(NM self) {
+    size_t n = 0;
+
+    if (!self) return 0;
+    if (is_inner(self)) return nm_leaves(self->l) + nm_leaves(self->r);
+    if (!self->bits) return 1;
+    for (int pos = 0, k; bits_next(bits_of(self), &pos, &k) >= 0;) n++;
+    return n;
+}
+
+size_t nm_split(NM self, NM *part, size_t n) {
+    size_t k = 0, inner;
+
+    if (!self || !n) return 0;
+    part[k++] = self;
+    /* open up a whole level at a time while the result still fits,
+     * working backwards so each node makes room for its children */
+    for (;;) {
+        for (size_t i = inner = 0; i < k; i++)
+            inner += is_inner(part[i]);
+        if (!inner || k + inner > n) return k;
+        for (size_t i = k, j = k + inner; i-- > 0;) {
+            if (!is_inner(part[i])) {
+                part[--j] = part[i];
+            } else {
+                NM p = part[i];
+                part[--j] = p->r;
+                part[--j] = p->l;
+            }
+        }
+        k += inner;
+    }
+}
+
+int nm_lookup(NM self, struct in6_addr *s6, nm_walk_cb cb, void *user) {
+    u128_t a = u128_of_v6(s6);
+
+    while (self && u128_lcp(a, self->neta) >= self->len) {
+        if (self->bits) {
+            /* the covering prefix is the largest aligned run of set
+             * bits around the address */
+            struct nm_bits *b = bits_of(self);
+            int i = u128_lo(a) & 0xff, k = 0;
+            if (!bits_all(b->set, i, 1)) return 0;
+            while (k < 7 && bits_all(b->set, i >> (k + 1) << (k + 1), 2 << k))
+                k++;
+            i = i >> k << k;
+            nm_emit(bits_addr(b, i), 128 - k, bits_domain(b, i, k), cb, user);
+            return 1;
+        }
+        if (is_leaf(self)) {
+            nm_emit(self->neta, self->len, self->domain, cb, user);
+            return 1;
+        }
+        self = u128_bit(a, self->len) ? self->r : self->l;
+    }
+    return 0;
+}
+
+/* Streaming aggregation of address ordered input.  Finished prefixes
+ * wait on a stack until no later input could land inside them or
+ * complete their buddy.  Once everything before a gap is flushed, the
+ * contiguous run left over is a chain of left children with ever longer
+ * prefixes, so apart from the entries of the input being worked on the
+ * stack holds at most one entry per prefix length. */
+struct nm_pend {
+    u128_t neta;
+    uint8_t len;
+    int domain;
+};
+
+struct nm_stream {
+    struct nm_pend *stk;
+    size_t n, cap;
+    int started;
+    u128_t last;
+    size_t emitted;
+    nm_walk_cb cb;
+    void *user;
+};
+
+static inline u128_t pend_end(struct nm_pend *a) {
+    return u128_or(a->neta, u128_not(u128_mask(a->len)));
+}
+
+static inline int pend_covers(struct nm_pend *a, struct nm_pend *b) {
+    return a->len <= b->len &&
+        0 == u128_cmp(u128_and(b->neta, u128_mask(a->len)), a->neta);
+}
+
+static inline int pend_buddies(struct nm_pend *a, struct nm_pend *b) {
+    if (a->len != b->len || a->len == 0) return 0;
+    u128_t bit = u128_xor(u128_mask(a->len), u128_mask(a->len - 1));
+    return !u128_bit(a->neta, a->len - 1) &&
+        0 == u128_cmp(u128_xor(a->neta, b->neta), bit);
+}
+
+/* is there a gap between a and whatever starts at next? */
+static inline int pend_gap(struct nm_pend *a, u128_t next) {
+    int carry;
+    u128_t after = u128_add(pend_end(a), u128(0, 1), &carry);
+    return carry || u128_cmp(after, next) != 0;
+}
+
+static void stream_emit(struct nm_stream *s, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        nm_emit(s->stk[i].neta, s->stk[i].len, s->stk[i].domain,
+                s->cb, s->user);
+    s->emitted += n;
+    s->n -= n;
+    memmove(s->stk, s->stk + n, s->n * sizeof(struct nm_pend));
+}
+
+/* every pending entry ends before next and no input will ever start
+ * below it, so anything ahead of a gap and any leading right child
+ * (or the whole space) is final */
+static void stream_settle(struct nm_stream *s, u128_t next) {
+    size_t done = 0;
+    for (size_t i = 0; i < s->n; i++)
+        if (pend_gap(&s->stk[i], i + 1 < s->n ? s->stk[i + 1].neta : next))
+            done = i + 1;
+    while (done < s->n && (s->stk[done].len == 0 ||
+            u128_bit(s->stk[done].neta, s->stk[done].len - 1)))
+        done++;
+    if (done) stream_emit(s, done);
+}
+
+/* p must start beyond everything pending */
+static void stream_push(struct nm_stream *s, struct nm_pend p) {
+    if (s->n == s->cap) {
+        s->cap = s->cap ? 2 * s->cap : 136;
+        s->stk = realloc(s->stk, s->cap * sizeof(struct nm_pend));
+    }
+    s->stk[s->n++] = p;
+    while (s->n > 1 && pend_buddies(&s->stk[s->n - 2], &s->stk[s->n - 1])) {
+        struct nm_pend *a = &s->stk[s->n - 2], *b = &s->stk[s->n - 1];
+        a->len--;
+        a->domain = domain_and(a->domain, b->domain);
+        s->n--;
+    }
+}
+
+static void stream_init(struct nm_stream *s, nm_walk_cb cb, void *user) {
+    memset(s, 0, sizeof(struct nm_stream));
+    s->cb = cb;
+    s->user = user;
+}
+
+/* add a single prefix, input must be ordered by address then shortest
+ * prefix first.  returns -1 if it is not. */
+static int stream_add(struct nm_stream *s, u128_t neta, uint8_t len,
+        int domain) {
+    struct nm_pend p = { u128_and(neta, u128_mask(len)), len, domain };
+    if (s->started && u128_cmp(p.neta, s->last) < 0) return -1;
+    s->started = 1;
+    s->last = p.neta;
+    /* only the top entry can overlap, either side may cover the other */
+    if (s->n && pend_covers(&s->stk[s->n - 1], &p)) {
+        struct nm_pend *top = &s->stk[s->n - 1];
+        top->domain = domain_and(top->domain, p.domain);
+        return 0;
+    }
+    while (s->n && pend_covers(&p, &s->stk[s->n - 1])) {
+        p.domain = domain_and(p.domain, s->stk[s->n - 1].domain);
+        s->n--;
+    }
+    stream_settle(s, p.neta);
+    stream_push(s, p);
+    return 0;
+}
+
+static void stream_finish(struct nm_stream *s) {
+    stream_emit(s, s->n);
+    free(s->stk);
+}
+
+NM_STREAM nm_stream_new(nm_walk_cb cb, void *user) {
+    NM_STREAM s = malloc(sizeof(struct nm_stream));
+    stream_init(s, cb, user);
+    return s;
+}
+
+static void stream_node(NM_STREAM s, NM self) {
+    if (self->l) stream_node(s, self->l);
+    if (self->bits) {
+        struct nm_bits *b = bits_of(self);
+        for (int pos = 0, i, k; (i = bits_next(b, &pos, &k)) >= 0;)
+            stream_push(s, (struct nm_pend){ bits_addr(b, i), 128 - k,
+                    bits_domain(b, i, k) });
+    } else if (is_leaf(self)) {
+        stream_push(s, (struct nm_pend){ self->neta, self->len,
+                self->domain });
+    }
+    if (self->r) stream_node(s, self->r);
+}
+
+static inline u128_t first_addr(NM self) {
+    while (is_inner(self)) self = self->l;
+    if (self->bits)
+        return bits_addr(bits_of(self), bits_scan(bits_of(self)->set, 0, 0));
+    return self->neta;
+}
+
+/* A whole input, such as a range, may overlap entries of the inputs
+ * before it.  Those entries are still pending, since nothing ending at
+ * or after the start of the last input has been emitted, so fold them
+ * back into the new tree and let nm_merge() sort it out. */
+int nm_stream_add(NM_STREAM s, NM self) {
+    if (!self) return 0;
+    u128_t start = first_addr(self);
+    if (s->started && u128_cmp(start, s->last) < 0) return -1;
+    s->started = 1;
+    s->last = start;
+    while (s->n && u128_cmp(pend_end(&s->stk[s->n - 1]), start) >= 0) {
+        struct nm_pend *top = &s->stk[--s->n];
+        self = nm_merge(self, nm_new_u128(top->neta, top->len, top->domain));
+    }
+    stream_settle(s, first_addr(self));
+    stream_node(s, self);
+    nm_free(self);
+    return 0;
+}
+
+size_t nm_stream_emitted(NM_STREAM s) {
+    return s->emitted;
+}
+
+NM nm_stream_tree(NM_STREAM s) {
+    NM self = NULL;
+
+    for (size_t i = 0; i < s->n; i++)
+        self = nm_merge(self, nm_new_u128(s->stk[i].neta, s->stk[i].len,
+                    s->stk[i].domain));
+    free(s->stk);
+    free(s);
+    return self;
+}
+
+void nm_stream_end(NM_STREAM s) {
+    stream_finish(s);
+    free(s);
+}
+
+/* run files are a sequence of fixed size records holding the address
+ * in network order, the prefix length and a v4 flag */
+#define NM_RUN_REC 18
+
+static inline int run_put(FILE *fp, u128_t neta, uint8_t len, int v4) {
+    uint8_t rec[NM_RUN_REC];
+    struct in6_addr s6 = v6_of_u128(neta);
+    memcpy(rec, s6.s6_addr, 16);
+    rec[16] = len;
+    rec[17] = v4;
+    return fwrite(rec, NM_RUN_REC, 1, fp) == 1 ? 0 : -1;
+}
+
+static inline int run_get(FILE *fp, struct nm_pend *p) {
+    uint8_t rec[NM_RUN_REC];
+    struct in6_addr s6;
+    if (fread(rec, NM_RUN_REC, 1, fp) != 1) return 0;
+    memcpy(s6.s6_addr, rec, 16);
+    p->neta = u128_of_v6(&s6);
+    p->len = rec[16];
+    p->domain = rec[17] ? AF_INET : AF_INET6;
+    return 1;
+}
+
+static int spill_node(NM self, FILE *fp) {
+    int rv = 0;
+    if (self->l) rv |= spill_node(self->l, fp);
+    if (self->bits) {
+        struct nm_bits *b = bits_of(self);
+        for (int pos = 0, i, k; (i = bits_next(b, &pos, &k)) >= 0;)
+            rv |= run_put(fp, bits_addr(b, i), 128 - k,
+                    is_v4_u128(bits_addr(b, i), bits_domain(b, i, k)));
+    } else if (is_leaf(self)) {
+        rv |= run_put(fp, self->neta, self->len, is_v4(self));
+    }
+    if (self->r) rv |= spill_node(self->r, fp);
+    return rv;
+}
+
+int nm_spill(NM self, FILE *fp) {
+    if (!self) return 0;
+    int rv = spill_node(self, fp);
+    nm_free(self);
+    return rv;
+}
+
+void nm_spill_cb(nm_cidr *c, void *fp) {
+    if (run_put((FILE *)fp, u128_of_v6(&c->addr.s6), c->scope,
+            c->domain == AF_INET) < 0)
+        panic("run write failed");
+}
+
+/* k-way merge, a binary heap of run heads ordered by address, then
+ * shorter prefix first, then by run order so the earliest input wins
+ * ties the same way nm_merge() does */
+struct run_head {
+    struct nm_pend p;
+    size_t run;
+};
+
+static inline int head_less(struct run_head *a, struct run_head *b) {
+    int c = u128_cmp(a->p.neta, b->p.neta);
+    if (c) return c < 0;
+    if (a->p.len != b->p.len) return a->p.len < b->p.len;
+    return a->run < b->run;
+}
+
+static void heap_down(struct run_head *h, size_t n, size_t i) {
+    for (;;) {
+        size_t m = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < n && head_less(&h[l], &h[m])) m = l;
+        if (r < n && head_less(&h[r], &h[m])) m = r;
+        if (m == i) return;
+        struct run_head t = h[i];
+        h[i] = h[m];
+        h[m] = t;
+        i = m;
+    }
+}
+
+int nm_unspill(FILE **runs, size_t n, nm_walk_cb cb, void *user) {
+    struct run_head *h = calloc(n ? n : 1, sizeof(struct run_head));
+    struct nm_stream s;
+    size_t hn = 0;
+    int rv = 0;
+
+    stream_init(&s, cb, user);
+    for (size_t i = 0; i < n; i++) {
+        rewind(runs[i]);
+        if (run_get(runs[i], &h[hn].p)) h[hn++].run = i;
+    }
+    for (size_t i = hn; i-- > 0;) heap_down(h, hn, i);
+    while (hn) {
+        if (stream_add(&s, h[0].p.neta, h[0].p.len, h[0].p.domain) < 0)
+            rv = -1;
+        if (!run_get(runs[h[0].run], &h[0].p)) h[0] = h[--hn];
+        heap_down(h, hn, 0);
+    }
+    stream_finish(&s);
+    for (size_t i = 0; i < n; i++)
+        if (ferror(runs[i])) rv = -1;
+    free(h);
+    return rv;
+}
+
+/* Duplicate prefilter.  An open addressing table of single prefixes
+ * already merged, so repeats can be dropped before walking the tree.
+ * When it fills up it doubles if it has been earning its keep, and
+ * otherwise starts over at the same size, so input with little
+ * repetition costs a fixed amount of memory.  It never grows past
+ * DEDUP_MAX_BITS, 128MiB, or the size it was given. */
+struct dedup_slot {
+    u128_t neta;
+    uint8_t len, used;
+    int domain;
+};
+
+struct nm_dedup {
+    struct dedup_slot *slot;
+    size_t bits, fill, max_bits;
+    size_t lookups, hits;      /* totals, for the report */
+    size_t win_lookups, win_hits; /* since the table last filled */
+};
+
+#define DEDUP_MIN_BITS 12
+#define DEDUP_GROW_BITS 16
+#define DEDUP_MAX_BITS 22
+
+static void dedup_alloc(NM_DEDUP d, size_t bits) {
+    d->bits = bits;
+    d->fill = 0;
+    d->slot = calloc((size_t)1 << bits, sizeof(struct dedup_slot));
+    d->win_lookups = d->win_hits = 0;
+}
+
+NM_DEDUP nm_dedup_new(size_t max) {
+    NM_DEDUP d = calloc(1, sizeof(struct nm_dedup));
+    d->max_bits = DEDUP_MAX_BITS;
+    while (max && d->max_bits > DEDUP_MIN_BITS &&
+            sizeof(struct dedup_slot) << d->max_bits > max)
+        d->max_bits--;
+    dedup_alloc(d, DEDUP_MIN_BITS);
+    return d;
+}
+
+static inline size_t dedup_hash(NM_DEDUP d, u128_t neta, uint8_t len) {
+    uint64_t v = (u128_hi(neta) * 0x9e3779b97f4a7c15ULL) ^
+        (u128_lo(neta) * 0xc2b2ae3d27d4eb4fULL) ^ len;
+    v ^= v >> 29;
+    return (v * 0xbf58476d1ce4e5b9ULL) >> (64 - d->bits);
+}
+
+static void dedup_insert(NM_DEDUP d, struct dedup_slot *e) {
+    size_t mask = ((size_t)1 << d->bits) - 1;
+    for (size_t i = dedup_hash(d, e->neta, e->len);; i = (i + 1) & mask)
+        if (!d->slot[i].used) {
+            d->slot[i] = *e;
+            d->fill++;
+            return;
+        }
+}
+
+static void dedup_full(NM_DEDUP d) {
+    struct dedup_slot *old = d->slot;
+    size_t n = (size_t)1 << d->bits;
+
+    /* small tables always grow, past that keep growing while repeats
+     * are common enough to pay for the memory */
+    if (d->bits < d->max_bits && (d->bits < DEDUP_GROW_BITS ||
+            d->win_hits * 64 >= d->win_lookups)) {
+        dedup_alloc(d, d->bits + 1);
+        for (size_t i = 0; i < n; i++)
+            if (old[i].used) dedup_insert(d, &old[i]);
+    } else {
+        dedup_alloc(d, d->bits);
+    }
+    free(old);
+}
+
+int nm_dedup_seen(NM_DEDUP d, NM self) {
+    if (!is_leaf(self)) return 0;
+    size_t mask = ((size_t)1 << d->bits) - 1;
+    d->lookups++;
+    d->win_lookups++;
+    for (size_t i = dedup_hash(d, self->neta, self->len);; i = (i + 1) & mask) {
+        struct dedup_slot *e = &d->slot[i];
+        if (!e->used) break;
+        if (e->len == self->len && e->domain == self->domain &&
+                0 == u128_cmp(e->neta, self->neta)) {
+            d->hits++;
+            d->win_hits++;
+            return 1;
+        }
+    }
+    struct dedup_slot e = { self->neta, self->len, 1, self->domain };
+    dedup_insert(d, &e);
+    if (2 * d->fill > mask) dedup_full(d);
+    return 0;
+}
+
+void nm_dedup_free(NM_DEDUP d) {
+    status("dedup: %zu of %zu entries were repeats (%.1f%%), %zu slots",
+            d->hits, d->lookups,
+            d->lookups ? 100.0 * d->hits / d->lookups : 0.0,
+            (size_t)1 << d->bits);
+    free(d->slot);
+    free(d);
+}
+
+/* A tree flattened into an array, each node with its parent's index,
+ * and a binary heap of indexes into it, for folding a tree up from the
+ * bottom in some order of cost. */
+struct heap_ent {
+    NM nm;
+    size_t parent;
+    double cost;
+};
+
+typedef int (*heap_less)(struct heap_ent *, size_t, size_t);
+
+static size_t heap_flatten(NM self, size_t parent, struct heap_ent *e,
+        size_t n) {
+    e[n].nm = self;
+    e[n].parent = parent;
+    parent = n++;
+    if (self->l) n = heap_flatten(self->l, parent, e, n);
+    if (self->r) n = heap_flatten(self->r, parent, e, n);
+    return n;
+}
+
+static void heap_push(struct heap_ent *e, size_t *heap, size_t *n,
+        size_t i, heap_less less) {
+    size_t c = (*n)++;
+    while (c > 0 && less(e, i, heap[(c - 1) / 2])) {
+        heap[c] = heap[(c - 1) / 2];
+        c = (c - 1) / 2;
+    }
+    heap[c] = i;
+}
+
+static size_t heap_pop(struct heap_ent *e, size_t *heap, size_t *n,
+        heap_less less) {
+    size_t top = heap[0], i = 0, last = heap[--*n];
+    for (;;) {
+        size_t c = 2 * i + 1;
+        if (c >= *n) break;
+        if (c + 1 < *n && less(e, heap[c + 1], heap[c])) c++;
+        if (!less(e, heap[c], last)) break;
+        heap[i] = heap[c];
+        i = c;
+    }
+    if (*n) heap[i] = last;
+    return top;
+}
+
+/* Heavy hitters.  Weighted prefixes go into a tree of their own where
+ * each keeps its node and equal ones add up.  When the tree outgrows
+ * its budget the lightest leaves are folded into their parents, which
+ * then stand for that weight, until it is down to half.  New input
+ * under a folded prefix gets nodes of its own again, so a prefix that
+ * only turns heavy later still has a chance to show. */
+#define HH_SLACK 64
+#define HH_MIN_BUDGET 4096
+
+struct nm_hh {
+    NM nm;
+    size_t k, budget, nodes, folded;
+    uint64_t total;
+};
+
+NM_HH nm_hh_new(size_t k) {
+    NM_HH h = calloc(1, sizeof(struct nm_hh));
+    h->k = k;
+    h->budget = k < HH_MIN_BUDGET / HH_SLACK ? HH_MIN_BUDGET : k * HH_SLACK;
+    return h;
+}
+
+/* lightest first, ties going to the lower address */
+static int hh_less(struct heap_ent *e, size_t a, size_t b) {
+    uint64_t wa = *weight_of(e[a].nm), wb = *weight_of(e[b].nm);
+    return wa < wb || (wa == wb && a < b);
+}
+
+/* fold leaves, lightest first, until the tree is down to nodes */
+static void hh_fold(NM_HH h, size_t nodes) {
+    struct heap_ent *e;
+    size_t *heap, n, hn = 0;
+
+    e = malloc(h->nodes * sizeof(struct heap_ent));
+    heap = malloc(h->nodes * sizeof(size_t));
+    n = heap_flatten(h->nm, SIZE_MAX, e, 0);
+    for (size_t i = 0; i < n; i++)
+        if (is_leaf(e[i].nm)) heap_push(e, heap, &hn, i, hh_less);
+    while (hn && h->nodes > nodes) {
+        size_t i = heap_pop(e, heap, &hn, hh_less);
+        NM self = e[i].nm, up;
+        if (e[i].parent == SIZE_MAX) break;
+        up = e[e[i].parent].nm;
+        *weight_of(up) += *weight_of(self);
+        if (up->l == self) up->l = NULL;
+        else up->r = NULL;
+        nm_del(self);
+        h->nodes--;
+        h->folded++;
+        if (is_leaf(up)) heap_push(e, heap, &hn, e[i].parent, hh_less);
+    }
+    free(heap);
+    free(e);
+}
+
+void nm_hh_add(NM_HH h, NM self, uint64_t weight) {
+    struct merge_ctx ctx = { .call = merge_step, .weighted = 1 };
+    u128_t neta;
+    uint8_t len;
+    int domain;
+    size_t live;
+
+    /* a range counts against the smallest prefix covering it */
+    neta = self->neta;
+    len = self->len;
+    domain = self->domain;
+    nm_free(self);
+    if (!weight) return;
+    h->total += weight;
+    live = nm_live;
+    self = weighted_new(neta, len, domain, weight);
+    h->nm = ctx.call(&ctx, h->nm, self);
+    h->nodes += nm_live - live;
+    if (h->nodes > h->budget) hh_fold(h, h->budget / 2);
+}
+
+static void hh_walk(NM self, nm_walk_cb cb, void *user) {
+    uint64_t weight = *weight_of(self);
+    if (weight) {
         nm_cidr cidr = {
             .domain = is_v4(self) ? AF_INET : AF_INET6,
             .addr = { .s6 = v6_of_u128(self->neta) },
             .mask = { .s6 = v6_of_u128(u128_mask(self->len)) },
             .scope = self->len,
+            .weight = weight,
         };
         cb(&cidr, user);
     }
-    nm_walk(self->r, cb, user);
+    if (self->l) hh_walk(self->l, cb, user);
+    if (self->r) hh_walk(self->r, cb, user);
+}
+
+/* A prefix is a heavy hitter at threshold t if the weight under it
+ * that no heavy hitter further down claims comes to t or more.  This
+ * counts them, and with claim set leaves each node holding the weight
+ * it claims, returning whatever is left over. */
+static uint64_t hh_claim(NM self, uint64_t t, size_t *n, int claim) {
+    uint64_t w = *weight_of(self);
+    if (self->l) w += hh_claim(self->l, t, n, claim);
+    if (self->r) w += hh_claim(self->r, t, n, claim);
+    if (claim) *weight_of(self) = w >= t ? w : 0;
+    if (w < t) return w;
+    (*n)++;
+    return 0;
+}
+
+void nm_hh_end(NM_HH h, nm_walk_cb cb, void *user) {
+    uint64_t lo = 1, hi = h->total + 1, rest = 0;
+    size_t n = 0;
+
+    if (h->nm) {
+        /* the lowest threshold that leaves at most k */
+        while (lo < hi) {
+            uint64_t t = lo + (hi - lo) / 2;
+            n = 0;
+            hh_claim(h->nm, t, &n, 0);
+            if (n <= h->k) hi = t;
+            else lo = t + 1;
+        }
+        n = 0;
+        rest = hh_claim(h->nm, lo, &n, 1);
+        hh_walk(h->nm, cb, user);
+        nm_free(h->nm);
+    }
+    status("top: %zu prefixes at threshold %" PRIu64 " from total weight %"
+            PRIu64 ", %" PRIu64 " unclaimed, %zu nodes folded on the way",
+            n, lo, h->total, rest, h->folded);
+    free(h);
+}
+
+/* Online coarsening.  When a tree outgrows its budget, the subtrees
+ * that cost the fewest extra addresses to replace with the prefix
+ * covering them are collapsed until it is back under by a margin, so
+ * the heap is only rebuilt after the tree has grown by that margin
+ * again and the work is spread over many merges.  Only a region or an
+ * internal node over two leaves can be collapsed, which then may make
+ * its parent one.
+ *
+ * Between rebuilds the tree's size is followed by how nm_live moves,
+ * which also sees nodes allocated and freed elsewhere, so that is only
+ * a cue to count the tree itself. */
+#define COARSEN_SLACK 8
+
+struct nm_budget {
+    size_t limit, nodes, seen, collapsed;
+    double over;
+};
+
+NM_BUDGET nm_budget_new(size_t nodes) {
+    NM_BUDGET b = calloc(1, sizeof(struct nm_budget));
+    b->limit = nodes;
+    /* only count what is grown from here on */
+    b->seen = nm_live;
+    return b;
+}
+
+/* 2^(128 - len) without libm */
+static inline double span(uint8_t len) {
+    uint8_t n = 128 - len;
+    double d = (double)(1ULL << (n & 63));
+    if (n >= 64) d *= 18446744073709551616.0;
+    if (n == 128) d *= 18446744073709551616.0;
+    return d;
+}
+
+static int coarse_twig(NM self) {
+    return self->bits || (self->l && self->r &&
+        is_leaf(self->l) && is_leaf(self->r));
+}
+
+/* how many addresses collapsing a twig adds */
+static double coarse_cost(NM self) {
+    double have = 0;
+
+    if (self->bits) {
+        for (int j = 0; j < NM_BITS_WORDS; j++)
+            have += u64_popc(bits_of(self)->set[j]);
+        return span(NM_BITS_LEN) - have;
+    }
+    return span(self->len) - span(self->l->len) - span(self->r->len);
+}
+
+/* cheapest first, ties going to the lower address */
+static int coarse_less(struct heap_ent *e, size_t a, size_t b) {
+    return e[a].cost < e[b].cost || (e[a].cost == e[b].cost && a < b);
+}
+
+static void coarse_collapse(NM_BUDGET b, struct heap_ent *e, size_t i) {
+    NM self = e[i].nm, leaf = self;
+
+    b->over += e[i].cost;
+    b->collapsed++;
+    if (self->bits) {
+        leaf = nm_new_u128(self->neta, NM_BITS_LEN, self->domain);
+    } else {
+        self->domain = domain_merge(self->l, self->r);
+        nm_del(self->l);
+        nm_del(self->r);
+        self->l = self->r = NULL;
+    }
+    if (e[i].parent != SIZE_MAX) {
+        NM up = e[e[i].parent].nm;
+        if (up->l == self) up->l = leaf;
+        else up->r = leaf;
+    }
+    if (leaf != self) nm_del(self);
+    e[i].nm = leaf;
+}
+
+/* entries in the flattened tree, and its share of nm_nodes() */
+static size_t coarse_size(NM self, size_t *nodes) {
+    *nodes += self->bits ? NM_BITS_WEIGHT : 1;
+    return 1 + (self->l ? coarse_size(self->l, nodes) : 0) +
+        (self->r ? coarse_size(self->r, nodes) : 0);
+}
+
+static NM coarsen(NM_BUDGET b, NM self, size_t nodes) {
+    struct heap_ent *e;
+    size_t *heap, n, hn = 0, live;
+
+    b->nodes = 0;
+    n = coarse_size(self, &b->nodes);
+    if (b->nodes <= b->limit) return self;
+    e = malloc(n * sizeof(struct heap_ent));
+    heap = malloc(n * sizeof(size_t));
+    heap_flatten(self, SIZE_MAX, e, 0);
+    for (size_t i = 0; i < n; i++) {
+        if (!coarse_twig(e[i].nm)) continue;
+        e[i].cost = coarse_cost(e[i].nm);
+        heap_push(e, heap, &hn, i, coarse_less);
+    }
+    /* collapsing only ever frees nodes of this tree */
+    live = nm_live;
+    while (hn && b->nodes - (live - nm_live) > nodes) {
+        size_t i = heap_pop(e, heap, &hn, coarse_less);
+        coarse_collapse(b, e, i);
+        /* a parent that is now exactly covered is an aggregate, which
+         * merges leave collapsed, so do that right away */
+        while ((i = e[i].parent) != SIZE_MAX && coarse_twig(e[i].nm)) {
+            e[i].cost = coarse_cost(e[i].nm);
+            if (e[i].cost > 0) {
+                heap_push(e, heap, &hn, i, coarse_less);
+                break;
+            }
+            coarse_collapse(b, e, i);
+        }
+    }
+    b->nodes -= live - nm_live;
+    self = e[0].nm;
+    free(heap);
+    free(e);
+    return self;
+}
+
+NM nm_budget_check(NM_BUDGET b, NM self) {
+    /* what moved since the last look, never going below nothing */
+    size_t gone = b->seen > nm_live ? b->seen - nm_live : 0;
+    b->nodes += nm_live > b->seen ? nm_live - b->seen : 0;
+    b->nodes -= gone < b->nodes ? gone : b->nodes;
+    if (self && b->nodes > b->limit)
+        self = coarsen(b, self, b->limit - b->limit / COARSEN_SLACK);
+    b->seen = nm_live;
+    return self;
+}
+
+void nm_budget_free(NM_BUDGET b) {
+    errno = 0;
+    if (b->collapsed)
+        warn("node budget: %zu subtrees collapsed, covering at most %.0f more "
+                "addresses", b->collapsed, b->over);
+    else
+        status("node budget: never reached");
+    free(b);
+}
+
+/* Interval sweep.  Ranges are kept as their ends instead of being cut
+ * into prefixes and merged one by one, and overlapping or touching
+ * ones are joined by sorting them, so each part of the union is only
+ * cut into prefixes once.  The array is swept in place whenever it
+ * fills, and only grows if that did not free half of it.  The two
+ * notations are swept apart so the tree still sees which addresses
+ * came in which one. */
+#define SWEEP_MIN 1024
+
+struct sweep_iv {
+    u128_t lo, hi;
+    int domain;
+};
+
+struct nm_sweep {
+    struct sweep_iv *iv;
+    size_t n, size, ranges;
+};
+
+NM_SWEEP nm_sweep_new(void) {
+    NM_SWEEP s = calloc(1, sizeof(struct nm_sweep));
+    s->size = SWEEP_MIN;
+    s->iv = malloc(s->size * sizeof(struct sweep_iv));
+    return s;
+}
+
+static int sweep_cmp(const void *pa, const void *pb) {
+    const struct sweep_iv *a = pa, *b = pb;
+    if (a->domain != b->domain) return a->domain - b->domain;
+    return u128_cmp(a->lo, b->lo);
+}
+
+static void sweep_compact(NM_SWEEP s) {
+    size_t n = 0;
+
+    if (!s->n) return;
+    qsort(s->iv, s->n, sizeof(struct sweep_iv), sweep_cmp);
+    for (size_t i = 1; i < s->n; i++) {
+        struct sweep_iv *cur = &s->iv[n], *next = &s->iv[i];
+        int carry;
+        u128_t after = u128_add(cur->hi, u128(0, 1), &carry);
+        if (next->domain == cur->domain &&
+                (carry || u128_cmp(next->lo, after) <= 0)) {
+            if (u128_cmp(next->hi, cur->hi) > 0) cur->hi = next->hi;
+        } else {
+            s->iv[++n] = *next;
+        }
+    }
+    s->n = n + 1;
+}
+
+int nm_sweep_str(NM_SWEEP s, const char *str, int flags, NM *out) {
+    NM end = NULL, self = parse_spec(str, flags, &end);
+
+    *out = NULL;
+    if (!self) return 0;
+    if (!end) {
+        *out = self;
+        return 1;
+    }
+    if (s->n == s->size) {
+        sweep_compact(s);
+        if (s->n > s->size / 2) {
+            s->size *= 2;
+            s->iv = realloc(s->iv, s->size * sizeof(struct sweep_iv));
+        }
+    }
+    seq_order(&self, &end);
+    s->iv[s->n++] = (struct sweep_iv){
+        self->neta, end->neta, domain_merge(self, end),
+    };
+    s->ranges++;
+    nm_free(self);
+    nm_free(end);
+    return 1;
+}
+
+NM nm_sweep_end(NM_SWEEP s, NM self) {
+    sweep_compact(s);
+    for (size_t i = 0; i < s->n; i++)
+        self = seq_merge(self, s->iv[i].lo, s->iv[i].hi, s->iv[i].domain);
+    status("sweep: %zu ranges joined into %zu", s->ranges, s->n);
+    free(s->iv);
+    free(s);
+    return self;
 }
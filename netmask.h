@@ -1,3 +1,7 @@
+#ifndef _HAVE_NETMASK_H
+#define _HAVE_NETMASK_H
+
+#include <stdio.h>
 #include <netinet/in.h>
 #include <netdb.h>
 
@@ -13,6 +17,13 @@ NM nm_new_ai(struct addrinfo *);
 
 NM nm_new_str(const char *, int flags);
 
+/* with NM_USE_DNS, nm_new_str() hands names to cb instead of looking
+ * them up itself, such as to cache the answers.  cb returns the tree
+ * of addresses for the name, or NULL. */
+typedef NM (*nm_resolve_cb)(const char *name, void *user);
+
+void nm_resolver(nm_resolve_cb, void *user);
+
 /* nm_merge() returns the union of the two trees passed in.  it is
  * destructive recycling branches from both sides and freeing unneeded
  * fragments. */
@@ -34,6 +45,7 @@ typedef struct {
     int domain;
     nm_addr addr, mask;
     uint8_t scope;
+    uint64_t weight; /* only from nm_hh_end() */
 } nm_cidr;
 
 /* the void* is caller data */
@@ -41,6 +53,128 @@ typedef void (*nm_walk_cb)(nm_cidr *,void *p);
 
 void nm_walk(NM, nm_walk_cb, void *p);
 
+/* nm_split() fills part with at most n disjoint subtrees that between
+ * them hold every prefix, in address order, for walking in pieces.  It
+ * returns how many it found.  nm_leaves() counts the prefixes in a
+ * tree. */
+size_t nm_split(NM, NM *part, size_t n);
+
+/* the pull side of nm_walk(), for going through a tree in step with
+ * something else.  nm_iter_next() fills in the next prefix and returns
+ * 1, or returns 0 at the end.  The tree must not change meanwhile. */
+typedef struct nm_iter *NM_ITER;
+
+NM_ITER nm_iter_new(NM);
+
+int nm_iter_next(NM_ITER, nm_cidr *);
+
+void nm_iter_free(NM_ITER);
+
+size_t nm_leaves(NM);
+
+/* hands the prefix covering an address to the callback and returns 1,
+ * or returns 0 if there is none.  Prefixes in a tree never overlap, so
+ * this is also the longest match. */
+int nm_lookup(NM, struct in6_addr *, nm_walk_cb, void *p);
+
 void nm_free(NM);
 
+/* freezes a tree so that it can be the base of many others.  Merging
+ * into it copies only the nodes on the paths that change and shares the
+ * rest with the result, so it costs about the size of what is merged
+ * in times the depth.  nm_free() of a result frees only the nodes it
+ * does not share.  Shared nodes are never freed. */
+void nm_share(NM);
+
 void nm_dump(NM);
+
+/* number of tree nodes currently allocated across all trees, and the
+ * size of each one */
+size_t nm_nodes(void);
+
+size_t nm_node_size(void);
+
+/* out of core aggregation.  nm_spill() writes the leaves of a tree to
+ * a run file in address order and frees the tree.  nm_unspill() merges
+ * any number of runs, aggregating as it goes, and hands the result to
+ * a walk callback in address order.  It returns -1 if a run was
+ * unreadable or out of order.  nm_spill_cb is a walk callback that
+ * writes run records, so merged runs can be spilled again. */
+int nm_spill(NM, FILE *);
+
+int nm_unspill(FILE **, size_t, nm_walk_cb, void *);
+
+void nm_spill_cb(nm_cidr *, void *fp);
+
+/* duplicate prefilter.  nm_dedup_seen() returns nonzero if an identical
+ * single prefix was passed to it before, in which case merging this one
+ * would change nothing.  nm_dedup_free() reports the hit rate as a
+ * status message.  The table is not counted by nm_nodes(); max bounds
+ * its size in bytes, or 0 leaves it at the built in ceiling. */
+typedef struct nm_dedup *NM_DEDUP;
+
+NM_DEDUP nm_dedup_new(size_t max);
+
+int nm_dedup_seen(NM_DEDUP, NM);
+
+void nm_dedup_free(NM_DEDUP);
+
+/* Weighted heavy hitters in bounded memory.  nm_hh_add() counts weight
+ * against a prefix, or the smallest prefix covering a range, and frees
+ * it.  nm_hh_end() hands at most k prefixes to the callback in address
+ * order, each with the weight it accounts for that its more specific
+ * prefixes in the output do not, so the weights add up to the total,
+ * and frees the rest. */
+typedef struct nm_hh *NM_HH;
+
+NM_HH nm_hh_new(size_t k);
+
+void nm_hh_add(NM_HH, NM, uint64_t weight);
+
+void nm_hh_end(NM_HH, nm_walk_cb, void *);
+
+/* Bounded memory by giving up precision.  Call nm_budget_check() after
+ * each merge into the tree.  Once the tree's nodes pass the budget, it
+ * collapses the subtrees that cost the fewest extra addresses into the
+ * prefixes covering them and returns the smaller tree.  nm_budget_free()
+ * reports how many addresses that added. */
+typedef struct nm_budget *NM_BUDGET;
+
+NM_BUDGET nm_budget_new(size_t nodes);
+
+NM nm_budget_check(NM_BUDGET, NM);
+
+void nm_budget_free(NM_BUDGET);
+
+/* Range heavy input.  nm_sweep_str() parses a spec like nm_new_str(),
+ * returning 0 if it does not parse.  A range is held back and *out set
+ * to NULL, anything else is returned in *out.  nm_sweep_end() joins
+ * the ranges held, merges their union into the tree and returns it. */
+typedef struct nm_sweep *NM_SWEEP;
+
+NM_SWEEP nm_sweep_new(void);
+
+int nm_sweep_str(NM_SWEEP, const char *, int flags, NM *out);
+
+NM nm_sweep_end(NM_SWEEP, NM);
+
+/* streaming aggregation for input already sorted by address.  Finished
+ * prefixes are handed to the walk callback as soon as no later input
+ * could join them, and only a few hundred bytes are held pending.
+ * nm_stream_add() consumes the tree unless it starts below an earlier
+ * one, in which case it returns -1 and the caller still owns it.
+ * nm_stream_tree() gives up on streaming, returning whatever has not
+ * yet been emitted as a tree, and nm_stream_end() flushes the rest.
+ * Both free the stream. */
+typedef struct nm_stream *NM_STREAM;
+
+NM_STREAM nm_stream_new(nm_walk_cb, void *);
+
+int nm_stream_add(NM_STREAM, NM);
+
+size_t nm_stream_emitted(NM_STREAM);
+
+NM nm_stream_tree(NM_STREAM);
+
+void nm_stream_end(NM_STREAM);
+#endif
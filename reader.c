@@ -0,0 +1,628 @@
+/* reader.c - threaded input file reader for netmask
+ *
+ * Copyright (c) 2025  Robert Stone <talby@trap.mtview.ca.us>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "errors.h"
+#include "reader.h"
+
+#ifdef HAVE_ZLIB
+#  include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#  include <zstd.h>
+#endif
+
+/* The reader thread fills fixed size buffers and hands them to the
+ * parser through a single producer, single consumer ring.  Each side
+ * only ever writes its own index, so publishing a buffer is a release
+ * store and no locks are taken while data flows.  A side that finds the
+ * ring full or empty spins briefly, then sleeps on a condition variable
+ * until the other side publishes something, so an idle pipe costs
+ * nothing.  The lock is only taken when somebody sleeps. */
+#define RD_SLOTS 8
+#define RD_BUFSZ 65536
+/* how often, in ms, a reader blocked on a pipe checks for a stop */
+#define RD_POLL_MS 100
+
+struct rd_buf {
+    size_t len;
+    char data[RD_BUFSZ];
+};
+
+typedef enum { RD_PLAIN, RD_GZIP, RD_ZSTD } rd_format;
+
+struct reader {
+    int fd;
+    const char *path;
+    pthread_t thread;
+    struct rd_buf slot[RD_SLOTS];
+    atomic_size_t head, tail;
+    atomic_int done, stop;
+    /* bumped on every publish, for sleepers to wait on */
+    atomic_uint seq;
+    atomic_int sleepers;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    /* reader thread state */
+    rd_format format;
+    char in[RD_BUFSZ];
+    size_t in_pos, in_len;
+    const char *err;
+    int err_no, partial;
+#ifdef HAVE_ZLIB
+    z_stream z;
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_DCtx *zd;
+#endif
+    /* parser state */
+    int flags;
+    struct rd_buf *cur;
+    size_t pos, line, word_line;
+    const char *perr;
+    char word[1024];
+    /* JSON and CSV state, see rd_json() and rd_csv() */
+    const char *fields;
+    int back, depth, arr, match;
+    int col[2], ncol, header;
+    char part[512];
+};
+
+/* after changing head, tail, done or stop, wake the other side if it
+ * went to sleep */
+static void rd_signal(READER r) {
+    atomic_fetch_add(&r->seq, 1);
+    if (atomic_load(&r->sleepers)) {
+        pthread_mutex_lock(&r->lock);
+        pthread_cond_broadcast(&r->wake);
+        pthread_mutex_unlock(&r->lock);
+    }
+}
+
+/* spin briefly, then sleep until something is published after seen was
+ * read from seq.  Both seq and sleepers are sequentially consistent, so
+ * either the sleeper sees the new seq or rd_signal() sees the sleeper. */
+static void rd_wait(READER r, unsigned seen, unsigned *spins) {
+    if (++*spins < 64) {
+        sched_yield();
+        return;
+    }
+    pthread_mutex_lock(&r->lock);
+    atomic_fetch_add(&r->sleepers, 1);
+    while (atomic_load(&r->seq) == seen)
+        pthread_cond_wait(&r->wake, &r->lock);
+    atomic_fetch_sub(&r->sleepers, 1);
+    pthread_mutex_unlock(&r->lock);
+}
+
+/* read(), but giving up as if at eof once reader_close() asks, so a
+ * pipe that never ends or is slow can not hold the thread up */
+static ssize_t rd_read(READER r, char *dst, size_t cap) {
+    struct pollfd p = { .fd = r->fd, .events = POLLIN };
+    ssize_t n;
+
+    for (;;) {
+        if (atomic_load_explicit(&r->stop, memory_order_relaxed)) return 0;
+        n = poll(&p, 1, RD_POLL_MS);
+        if (n < 0 && errno != EINTR) break;
+        if (n > 0) break;
+    }
+    do n = read(r->fd, dst, cap);
+    while (n < 0 && errno == EINTR);
+    return n;
+}
+
+/* refill the compressed input buffer, 0 at eof, -1 on error */
+static ssize_t rd_input(READER r) {
+    ssize_t n = rd_read(r, r->in, RD_BUFSZ);
+
+    if (n < 0) {
+        r->err = "read";
+        r->err_no = errno;
+        return -1;
+    }
+    r->in_pos = 0;
+    r->in_len = n;
+    return n;
+}
+
+static ssize_t rd_plain(READER r, char *dst, size_t cap) {
+    if (r->in_pos == r->in_len && rd_input(r) <= 0)
+        return r->err ? -1 : 0;
+    size_t n = r->in_len - r->in_pos;
+    if (n > cap) n = cap;
+    memcpy(dst, r->in + r->in_pos, n);
+    r->in_pos += n;
+    return n;
+}
+
+#ifdef HAVE_ZLIB
+static ssize_t rd_gzip(READER r, char *dst, size_t cap) {
+    r->z.next_out = (Bytef *)dst;
+    r->z.avail_out = cap;
+    while (r->z.avail_out) {
+        if (r->in_pos == r->in_len) {
+            ssize_t n = rd_input(r);
+            if (n < 0) return -1;
+            if (n == 0) break;
+        }
+        r->partial = 1;
+        r->z.next_in = (Bytef *)r->in + r->in_pos;
+        r->z.avail_in = r->in_len - r->in_pos;
+        int rv = inflate(&r->z, Z_NO_FLUSH);
+        r->in_pos = r->in_len - r->z.avail_in;
+        if (rv == Z_STREAM_END) {
+            /* gzip files may hold several members back to back */
+            inflateReset(&r->z);
+            r->partial = 0;
+        } else if (rv != Z_OK && rv != Z_BUF_ERROR) {
+            r->err = r->z.msg ? r->z.msg : "inflate";
+            return -1;
+        }
+    }
+    return cap - r->z.avail_out;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static ssize_t rd_zstd(READER r, char *dst, size_t cap) {
+    ZSTD_outBuffer out = { dst, cap, 0 };
+    while (out.pos < out.size) {
+        if (r->in_pos == r->in_len) {
+            ssize_t n = rd_input(r);
+            if (n < 0) return -1;
+            if (n == 0) break;
+        }
+        ZSTD_inBuffer in = { r->in, r->in_len, r->in_pos };
+        size_t rv = ZSTD_decompressStream(r->zd, &out, &in);
+        r->in_pos = in.pos;
+        if (ZSTD_isError(rv)) {
+            r->err = ZSTD_getErrorName(rv);
+            return -1;
+        }
+        /* zero means a frame just ended */
+        r->partial = rv != 0;
+    }
+    return out.pos;
+}
+#endif
+
+static ssize_t rd_fill(READER r, char *dst, size_t cap) {
+    ssize_t n;
+
+    switch (r->format) {
+#ifdef HAVE_ZLIB
+        case RD_GZIP: n = rd_gzip(r, dst, cap); break;
+#endif
+#ifdef HAVE_ZSTD
+        case RD_ZSTD: n = rd_zstd(r, dst, cap); break;
+#endif
+        default: return rd_plain(r, dst, cap);
+    }
+    if (n == 0 && r->partial &&
+            !atomic_load_explicit(&r->stop, memory_order_relaxed)) {
+        r->err = "unexpected end of compressed input";
+        return -1;
+    }
+    return n;
+}
+
+/* look at the first bytes for a compression magic number */
+static void rd_sniff(READER r) {
+    static const unsigned char gz[] = { 0x1f, 0x8b };
+    static const unsigned char zst[] = { 0x28, 0xb5, 0x2f, 0xfd };
+
+    /* a short first read from a pipe may split the magic, top it up */
+    while (r->in_len < sizeof(zst)) {
+        ssize_t n = rd_read(r, r->in + r->in_len, RD_BUFSZ - r->in_len);
+        if (n <= 0) break;
+        r->in_len += n;
+    }
+    r->format = RD_PLAIN;
+    if (r->in_len >= sizeof(gz) && !memcmp(r->in, gz, sizeof(gz))) {
+#ifdef HAVE_ZLIB
+        r->format = RD_GZIP;
+        /* 32 asks zlib to expect a gzip header */
+        if (inflateInit2(&r->z, 15 + 32) != Z_OK)
+            r->err = "inflateInit2";
+#else
+        r->err = "gzip support not compiled in";
+#endif
+    } else if (r->in_len >= sizeof(zst) && !memcmp(r->in, zst, sizeof(zst))) {
+#ifdef HAVE_ZSTD
+        r->format = RD_ZSTD;
+        if (!(r->zd = ZSTD_createDCtx()))
+            r->err = "ZSTD_createDCtx";
+#else
+        r->err = "zstd support not compiled in";
+#endif
+    }
+}
+
+static void *rd_main(void *arg) {
+    READER r = arg;
+    size_t head = 0;
+
+    rd_sniff(r);
+    while (!r->err) {
+        unsigned spins = 0, seen;
+        for (;;) {
+            seen = atomic_load(&r->seq);
+            if (head - atomic_load_explicit(&r->tail, memory_order_acquire)
+                    < RD_SLOTS)
+                break;
+            if (atomic_load_explicit(&r->stop, memory_order_relaxed))
+                goto out;
+            rd_wait(r, seen, &spins);
+        }
+        struct rd_buf *b = &r->slot[head % RD_SLOTS];
+        ssize_t n = rd_fill(r, b->data, RD_BUFSZ);
+        if (n <= 0) break;
+        b->len = n;
+        atomic_store_explicit(&r->head, ++head, memory_order_release);
+        rd_signal(r);
+    }
+out:
+#ifdef HAVE_ZLIB
+    if (r->format == RD_GZIP) inflateEnd(&r->z);
+#endif
+#ifdef HAVE_ZSTD
+    if (r->format == RD_ZSTD) ZSTD_freeDCtx(r->zd);
+#endif
+    atomic_store_explicit(&r->done, 1, memory_order_release);
+    rd_signal(r);
+    return NULL;
+}
+
+READER reader_open(const char *path, int flags, const char *fields) {
+    int fd = strcmp(path, "-") ? open(path, O_RDONLY) : 0;
+    if (fd < 0) return NULL;
+    READER r = calloc(1, sizeof(struct reader));
+    r->fd = fd;
+    r->path = path;
+    r->flags = flags;
+    r->line = 1;
+    r->fields = fields;
+    r->back = -1;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->wake, NULL);
+    if ((errno = pthread_create(&r->thread, NULL, rd_main, r))) {
+        if (fd) close(fd);
+        pthread_cond_destroy(&r->wake);
+        pthread_mutex_destroy(&r->lock);
+        free(r);
+        return NULL;
+    }
+    return r;
+}
+
+/* hand the current buffer back and wait for the next one */
+static int rd_next(READER r) {
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    unsigned spins = 0, seen;
+
+    if (r->cur) {
+        atomic_store_explicit(&r->tail, ++tail, memory_order_release);
+        rd_signal(r);
+        r->cur = NULL;
+    }
+    for (;;) {
+        seen = atomic_load(&r->seq);
+        if (atomic_load_explicit(&r->head, memory_order_acquire) != tail)
+            break;
+        if (atomic_load_explicit(&r->done, memory_order_acquire) &&
+                atomic_load_explicit(&r->head, memory_order_acquire) == tail)
+            return 0;
+        rd_wait(r, seen, &spins);
+    }
+    r->cur = &r->slot[tail % RD_SLOTS];
+    r->pos = 0;
+    return 1;
+}
+
+static inline int rd_getc(READER r) {
+    while (!r->cur || r->pos == r->cur->len)
+        if (!rd_next(r)) return -1;
+    return (unsigned char)r->cur->data[r->pos++];
+}
+
+static inline int rd_space(int c) {
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r' ||
+        c == '\v' || c == '\f';
+}
+
+/* skip to the end of the line, a buffer at a time */
+static void rd_skip_line(READER r) {
+    for (;;) {
+        if (!r->cur || r->pos == r->cur->len)
+            if (!rd_next(r)) return;
+        char *nl = memchr(r->cur->data + r->pos, '\n', r->cur->len - r->pos);
+        if (nl) {
+            r->pos = nl - r->cur->data + 1;
+            r->line++;
+            return;
+        }
+        r->pos = r->cur->len;
+    }
+}
+
+/* is key one of the comma separated names in spec */
+static int rd_field(const char *spec, const char *key) {
+    size_t n = strlen(key);
+    while (spec) {
+        if (!strncmp(spec, key, n) && (spec[n] == ',' || spec[n] == '\0'))
+            return 1;
+        if ((spec = strchr(spec, ',')))
+            spec++;
+    }
+    return 0;
+}
+
+static inline int rd_getc_line(READER r) {
+    int c = r->back;
+    if (c >= 0)
+        r->back = -1;
+    else if ((c = rd_getc(r)) == '\n')
+        r->line++;
+    return c;
+}
+
+/* read the rest of a JSON string into word, decoding escapes */
+static void rd_json_string(READER r) {
+    size_t n = 0;
+    int c;
+
+    while ((c = rd_getc_line(r)) >= 0 && c != '"') {
+        if (c == '\\') {
+            switch (c = rd_getc_line(r)) {
+                case 'b': c = '\b'; break;
+                case 'f': c = '\f'; break;
+                case 'n': c = '\n'; break;
+                case 'r': c = '\r'; break;
+                case 't': c = '\t'; break;
+                case 'u':
+                    /* nothing outside ASCII belongs in an address */
+                    for (int i = 0, v = 0; i < 4; i++) {
+                        int h = rd_getc_line(r);
+                        v = v << 4 | (h <= '9' ? h - '0' : (h | 0x20) - 'a' + 10);
+                        c = v < 0x80 ? v : '?';
+                    }
+                    break;
+            }
+            if (c < 0) break;
+        }
+        if (n < sizeof(r->word) - 1)
+            r->word[n++] = c;
+    }
+    r->word[n] = '\0';
+}
+
+/* The JSON reader is a tokenizer that remembers just enough to tell
+ * whether a string is the value of a wanted member or one of the
+ * strings directly in an array that is: the nesting depth and the
+ * depth of such an array.  Documents of any size need no more memory
+ * than that. */
+static const char *rd_json(READER r) {
+    int c;
+
+    while ((c = rd_getc_line(r)) >= 0) {
+        switch (c) {
+            case '{': case '[':
+                r->depth++;
+                if (c == '[' && r->match) r->arr = r->depth;
+                r->match = 0;
+                break;
+            case '}': case ']':
+                if (r->depth == r->arr) r->arr = 0;
+                r->depth--;
+                break;
+            case '"':
+                r->word_line = r->line;
+                rd_json_string(r);
+                while ((c = rd_getc_line(r)) >= 0 && rd_space(c));
+                if (c == ':') {
+                    r->match = rd_field(r->fields, r->word);
+                    break;
+                }
+                r->back = c;
+                if (r->match || (r->arr && r->depth == r->arr)) {
+                    r->match = 0;
+                    return r->word;
+                }
+                break;
+            case ',':
+                r->match = 0;
+                break;
+        }
+    }
+    return NULL;
+}
+
+/* resolve each column of the spec to an index, by number counting
+ * from 1 or else by name from the header line */
+static int rd_csv_cols(READER r) {
+    const char *p = r->fields;
+
+    for (r->ncol = 0; p && *p && r->ncol < 2; r->ncol++) {
+        char *end;
+        long v = strtol(p, &end, 10);
+        if (end != p && (*end == ',' || *end == '\0') && v > 0) {
+            r->col[r->ncol] = v - 1;
+        } else {
+            r->col[r->ncol] = -1;
+            r->header = 1;
+        }
+        if ((p = strchr(p, ',')))
+            p++;
+    }
+    if (p || !r->ncol) {
+        r->perr = "give one or two csv columns";
+        return -1;
+    }
+    return 0;
+}
+
+/* a header field has ended, see if it names a column we want */
+static void rd_csv_name(READER r, int f, size_t *n) {
+    const char *p = r->fields;
+
+    r->word[*n] = '\0';
+    for (int i = 0; i < r->ncol; i++) {
+        size_t len = strcspn(p, ",");
+        if (r->col[i] < 0 && len == *n && !strncmp(p, r->word, len))
+            r->col[i] = f;
+        p += len + (p[len] == ',');
+    }
+    *n = 0;
+}
+
+/* one CSV record, keeping the wanted columns.  A second column goes in
+ * part, since it has to be joined to the first.  While reading the
+ * header every field goes through rd_csv_name() instead.  Returns the
+ * number of fields seen, 0 at the end of input. */
+static int rd_csv_record(READER r, size_t *n, size_t *m) {
+    int c, f = 0, quoted = 0, any = 0;
+
+    *n = *m = 0;
+    r->word_line = r->line;
+    while ((c = rd_getc_line(r)) >= 0) {
+        any = 1;
+        if (quoted) {
+            if (c == '"' && (c = rd_getc_line(r)) != '"') {
+                quoted = 0;
+                r->back = c;
+                continue;
+            }
+        } else if (c == '"') {
+            quoted = 1;
+            continue;
+        } else if (c == ',' || c == '\n') {
+            if (r->header) rd_csv_name(r, f, n);
+            if (c == '\n') break;
+            f++;
+            continue;
+        } else if (c == '\r') {
+            continue;
+        }
+        if ((r->header || f == r->col[0]) && *n < sizeof(r->word) - 1)
+            r->word[(*n)++] = c;
+        else if (r->ncol > 1 && f == r->col[1] && *m < sizeof(r->part) - 1)
+            r->part[(*m)++] = c;
+    }
+    if (c < 0 && r->header) rd_csv_name(r, f, n);
+    r->word[*n] = '\0';
+    r->part[*m] = '\0';
+    return any ? f + 1 : 0;
+}
+
+/* CSV records become a single address spec from one column, or a
+ * range "first,last" from two */
+static const char *rd_csv(READER r) {
+    size_t n, m;
+
+    if (!r->ncol && rd_csv_cols(r) < 0)
+        return NULL;
+    if (r->header) {
+        rd_csv_record(r, &n, &m);
+        r->header = 0;
+        if (r->col[0] < 0 || (r->ncol > 1 && r->col[1] < 0)) {
+            r->perr = "csv column not found in header";
+            return NULL;
+        }
+    }
+    while (rd_csv_record(r, &n, &m)) {
+        /* blank lines and short records */
+        if (!n) continue;
+        if (r->ncol > 1) {
+            if (n + m + 2 > sizeof(r->word)) continue;
+            r->word[n++] = ',';
+            memcpy(r->word + n, r->part, m + 1);
+        }
+        return r->word;
+    }
+    return NULL;
+}
+
+const char *reader_word(READER r) {
+    size_t n = 0;
+    int c;
+
+    if (r->flags & READER_JSON) return rd_json(r);
+    if (r->flags & READER_CSV) return rd_csv(r);
+
+    for (;;) {
+        while ((c = rd_getc(r)) >= 0 && rd_space(c))
+            if (c == '\n') r->line++;
+        if (c < 0) return NULL;
+        if (c != '#' || !(r->flags & READER_COMMENTS)) break;
+        rd_skip_line(r);
+    }
+    r->word_line = r->line;
+    r->word[n++] = c;
+    while (n < sizeof(r->word) - 1) {
+        if (r->cur && r->pos < r->cur->len) {
+            /* stay on the fast path while inside one buffer */
+            c = (unsigned char)r->cur->data[r->pos];
+            if (rd_space(c)) break;
+            r->pos++;
+        } else if ((c = rd_getc(r)) < 0 || rd_space(c)) {
+            if (c == '\n') r->line++;
+            break;
+        }
+        r->word[n++] = c;
+    }
+    r->word[n] = '\0';
+    return r->word;
+}
+
+size_t reader_line(READER r) {
+    return r->word_line;
+}
+
+int reader_close(READER r) {
+    int rv = 0;
+
+    atomic_store_explicit(&r->stop, 1, memory_order_relaxed);
+    rd_signal(r);
+    pthread_join(r->thread, NULL);
+    pthread_cond_destroy(&r->wake);
+    pthread_mutex_destroy(&r->lock);
+    if (r->err) {
+        errno = r->err_no;
+        warn("%s: %s", r->path, r->err);
+        rv = -1;
+    }
+    if (r->perr) {
+        errno = 0;
+        warn("%s: %s", r->path, r->perr);
+        rv = -1;
+    }
+    if (r->fd) close(r->fd);
+    free(r);
+    return rv;
+}
@@ -0,0 +1,54 @@
+/* reader.h - threaded input file reader for netmask
+ *
+ * Copyright (c) 2025  Robert Stone <talby@trap.mtview.ca.us>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+#ifndef _HAVE_READER_H
+#define _HAVE_READER_H
+
+#include <stddef.h>
+
+typedef struct reader *READER;
+
+/* open a file, or "-" for stdin, and start a thread reading it.  gzip
+ * and zstd input is recognized by its magic number and decompressed on
+ * that thread if support was compiled in.  fields is only used by the
+ * READER_JSON and READER_CSV flags and must outlive the reader.
+ * Returns NULL with errno set if the file can not be opened. */
+READER reader_open(const char *path, int flags, const char *fields);
+
+/* skip from a word starting with '#' to the end of its line */
+#define READER_COMMENTS 1
+/* words are JSON strings that are the value of a member named in the
+ * comma separated fields, or directly inside an array that is */
+#define READER_JSON 2
+/* words are taken from the CSV column named in fields, by number from
+ * 1 or by header name.  With two columns a word is "first,second". */
+#define READER_CSV 4
+
+/* the next whitespace separated word of at most 1023 bytes, longer
+ * words are split, or NULL at the end of input.  The word is valid
+ * until the next call. */
+const char *reader_word(READER);
+
+/* line number the last word was found on */
+size_t reader_line(READER);
+
+/* stops the thread and frees the reader, without waiting for the rest
+ * of a pipe when called before the end of input.  Returns -1 after
+ * warning if a read or decompression error ended input early. */
+int reader_close(READER);
+#endif
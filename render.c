@@ -0,0 +1,195 @@
+/* render.c - parallel output for netmask
+ *
+ * Copyright (c) 2025  Robert Stone <talby@trap.mtview.ca.us>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "errors.h"
+#include "render.h"
+
+/* below this many tree nodes threads cost more than they save */
+#define RENDER_MIN_NODES 65536
+/* subtrees per thread to choose from when balancing */
+#define RENDER_SPLIT 16
+
+/* a run of consecutive subtrees, formatted into a memory buffer by a
+ * thread of its own */
+struct render_job {
+    NM *part;
+    size_t n;
+    nm_walk_cb cb;
+    FILE *fp;
+    char *buf;
+    size_t len;
+    pthread_t thread;
+    int started, failed;
+};
+
+static void render_parts(struct render_job *j, FILE *fp) {
+    for (size_t i = 0; i < j->n; i++)
+        nm_walk(j->part[i], j->cb, fp);
+}
+
+static void *render_main(void *p) {
+    struct render_job *j = p;
+    render_parts(j, j->fp);
+    fclose(j->fp);
+    return NULL;
+}
+
+/* cut the tree into nj runs of consecutive subtrees holding about the
+ * same number of prefixes each, returning how many prefixes there are
+ * and setting *np to how many subtrees.  part must have room for
+ * nj * RENDER_SPLIT subtrees. */
+static size_t cut(NM nm, struct render_job *job, size_t nj, NM *part,
+        nm_walk_cb cb, size_t *np) {
+    size_t *leaves = malloc(sizeof(size_t) * nj * RENDER_SPLIT);
+    size_t total = 0, have = 0, n, i, g;
+
+    n = *np = nm_split(nm, part, nj * RENDER_SPLIT);
+    for (i = 0; i < n; i++)
+        total += leaves[i] = nm_leaves(part[i]);
+    for (i = g = 0; g < nj; g++) {
+        size_t want = total * (g + 1) / nj;
+        job[g].part = part + i;
+        job[g].cb = cb;
+        /* the last run takes whatever is left */
+        while (i < n && (g + 1 == nj || have + leaves[i] / 2 < want))
+            have += leaves[i++], job[g].n++;
+    }
+    free(leaves);
+    return total;
+}
+
+void render(NM nm, nm_walk_cb cb, FILE *out, int jobs) {
+    struct render_job *job;
+    size_t total, nj = jobs, n, g;
+    NM *part;
+
+    if (jobs < 2 || nm_nodes() < RENDER_MIN_NODES) {
+        nm_walk(nm, cb, out);
+        return;
+    }
+    part = malloc(sizeof(NM) * nj * RENDER_SPLIT);
+    job = calloc(nj, sizeof(struct render_job));
+    total = cut(nm, job, nj, part, cb, &n);
+    status("rendering %zu prefixes in %zu pieces on %d threads",
+        total, n, jobs);
+
+    /* the first run goes straight out, while the others fill buffers */
+    for (g = 1; g < nj; g++) {
+        if (!job[g].n) continue;
+        job[g].fp = open_memstream(&job[g].buf, &job[g].len);
+        if (job[g].fp && !pthread_create(&job[g].thread, NULL,
+                    render_main, &job[g]))
+            job[g].started = 1;
+        else if (job[g].fp)
+            fclose(job[g].fp);
+    }
+    render_parts(&job[0], out);
+    for (g = 1; g < nj; g++) {
+        if (!job[g].started) {
+            /* no thread to spare, do it here */
+            render_parts(&job[g], out);
+        } else {
+            pthread_join(job[g].thread, NULL);
+            fwrite(job[g].buf, 1, job[g].len, out);
+        }
+        free(job[g].buf);
+    }
+    free(job);
+    free(part);
+}
+
+/* a thread writing every step'th shard file, opened only while it is
+ * written so that shards are not limited by open files */
+struct shard_set {
+    struct render_job *job;
+    size_t first, step, n;
+    const char *prefix;
+    int width;
+    pthread_t thread;
+    int started;
+};
+
+static int shard_path(char *path, size_t size, const char *prefix,
+        int width, size_t g) {
+    int n = snprintf(path, size, "%s%0*zu", prefix, width, g);
+
+    if (n < 0 || (size_t)n >= size) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+static void *shard_main(void *p) {
+    struct shard_set *s = p;
+    char path[4096];
+
+    for (size_t g = s->first; g < s->n; g += s->step) {
+        struct render_job *j = &s->job[g];
+        if (shard_path(path, sizeof(path), s->prefix, s->width, g) < 0 ||
+                !(j->fp = fopen(path, "w"))) {
+            j->failed = errno ? errno : EIO;
+            continue;
+        }
+        render_parts(j, j->fp);
+        if (ferror(j->fp)) j->failed = errno ? errno : EIO;
+        if (fclose(j->fp) && !j->failed) j->failed = errno ? errno : EIO;
+    }
+    return NULL;
+}
+
+int render_shards(NM nm, nm_walk_cb cb, const char *prefix, size_t shards,
+        int jobs) {
+    struct render_job *job = calloc(shards, sizeof(struct render_job));
+    NM *part = malloc(sizeof(NM) * shards * RENDER_SPLIT);
+    size_t nt = (size_t)jobs < shards ? (size_t)jobs : shards, total, n, g;
+    struct shard_set *set = calloc(nt, sizeof(struct shard_set));
+    char path[4096];
+    int width = 1, rv = 0;
+
+    for (g = shards - 1; g >= 10; g /= 10) width++;
+    total = cut(nm, job, shards, part, cb, &n);
+    status("writing %zu prefixes from %zu pieces in %zu shards on %zu "
+        "threads", total, n, shards, nt);
+    for (g = 0; g < nt; g++) {
+        set[g] = (struct shard_set){ .job = job, .first = g, .step = nt,
+            .n = shards, .prefix = prefix, .width = width };
+        if (g && !pthread_create(&set[g].thread, NULL, shard_main, &set[g]))
+            set[g].started = 1;
+    }
+    /* this thread takes the first set, and any no thread was made for */
+    for (g = 0; g < nt; g++)
+        if (!set[g].started) shard_main(&set[g]);
+    for (g = 0; g < nt; g++)
+        if (set[g].started) pthread_join(set[g].thread, NULL);
+    for (g = 0; g < shards; g++) {
+        if (!job[g].failed) continue;
+        shard_path(path, sizeof(path), prefix, width, g);
+        errno = job[g].failed;
+        warn("%s", path);
+        rv = -1;
+    }
+    free(set);
+    free(part);
+    free(job);
+    return rv;
+}
@@ -0,0 +1,40 @@
+/* render.h - parallel output for netmask
+ *
+ * Copyright (c) 2025  Robert Stone <talby@trap.mtview.ca.us>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+#ifndef _HAVE_RENDER_H
+#define _HAVE_RENDER_H
+
+#include <stdio.h>
+
+#include "netmask.h"
+
+/* nm_walk() for a callback that formats each prefix onto the FILE * it
+ * is given as user data.  Big trees are cut into subtrees of about the
+ * same number of prefixes, each formatted into its own buffer on up to
+ * jobs threads, and the buffers written to out in address order, so
+ * the output is the same as from a plain walk. */
+void render(NM, nm_walk_cb, FILE *out, int jobs);
+
+/* the same cut into shards address ranges with about the same number of
+ * prefixes, each written to its own file, named prefix followed by the
+ * shard number padded to the same width.  Up to jobs threads write them
+ * at once.  Every shard file is made, if need be empty.  Returns -1
+ * after warning about each shard that could not be written. */
+int render_shards(NM, nm_walk_cb, const char *prefix, size_t shards,
+    int jobs);
+#endif
@@ -0,0 +1,438 @@
+/* serve.c - answer address queries over a unix socket
+ *
+ * Copyright (c) 2025  Robert Stone <talby@trap.mtview.ca.us>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "errors.h"
+#include "mmdb.h"
+#include "serve.h"
+
+/* queries answered per read, and per round trip on the client side */
+#define SERVE_BATCH 1024
+#define SERVE_CONNS 256
+/* loop to reload thread: a set was retired, or stop was set */
+#define SERVE_SIG SIGUSR2
+
+/* The set is only ever read by the thread running the poll loop, and
+ * only between batches does it look for a new one.  A reload builds the
+ * new set on its own thread and publishes it with an atomic exchange;
+ * the loop takes it, answers every later query from it and hands the
+ * old one back to be freed on the reload thread, which by then it will
+ * never touch again.  So lookups never wait on a reload, never see a
+ * half built set, and all tree memory is managed on one thread at a
+ * time.  The loop nudges the reload thread with SERVE_SIG once it has
+ * let go of a set, so the memory comes back right away rather than at
+ * the next reload, and again when it is time to shut down. */
+struct snap {
+    NM nm;
+    struct snap *next;
+};
+
+struct conn {
+    int fd;
+    size_t in_len, out_pos, out_len;
+    unsigned char in[SERVE_BATCH * SERVE_QLEN];
+    unsigned char out[SERVE_BATCH * SERVE_ALEN];
+};
+
+struct server {
+    serve_load_cb load;
+    void *user;
+    sigset_t sigs;
+    int wake[2];
+    _Atomic(struct snap *) pending, retired;
+    atomic_int stop;
+};
+
+static void snap_free(struct snap *s) {
+    while (s) {
+        struct snap *next = s->next;
+        if (s->nm) nm_free(s->nm);
+        free(s);
+        s = next;
+    }
+}
+
+/* retired sets pile up on a list the reload thread empties in one go */
+static void snap_retire(struct server *sv, struct snap *s) {
+    s->next = atomic_load(&sv->retired);
+    while (!atomic_compare_exchange_weak(&sv->retired, &s->next, s));
+}
+
+static void server_wake(struct server *sv) {
+    char c = 0;
+    if (write(sv->wake[1], &c, 1) < 0 && errno != EAGAIN)
+        warn("wake");
+}
+
+static void *reloader(void *p) {
+    struct server *sv = p;
+    int sig;
+
+    for (;;) {
+        if (sigwait(&sv->sigs, &sig)) break;
+        snap_free(atomic_exchange(&sv->retired, NULL));
+        if (atomic_load(&sv->stop)) return NULL;
+        if (sig == SERVE_SIG) continue;
+        if (sig != SIGHUP) break;
+        status("reloading");
+        struct snap *s = calloc(1, sizeof(struct snap));
+        if (sv->load(&s->nm, sv->user) < 0) {
+            free(s);
+            warn("reload failed, still serving the previous set");
+            continue;
+        }
+        /* a set never picked up is as good as retired */
+        snap_free(atomic_exchange(&sv->pending, s));
+        server_wake(sv);
+        status("reloaded");
+    }
+    atomic_store(&sv->stop, 1);
+    server_wake(sv);
+    return NULL;
+}
+
+static void answer_cb(nm_cidr *c, void *p) {
+    unsigned char *a = p;
+    memcpy(a, c->addr.s6.s6_addr, 16);
+    a[16] = c->scope;
+    a[17] = c->domain == AF_INET ? 4 : 6;
+}
+
+static void answer(NM nm, struct conn *c) {
+    size_t n = c->in_len / SERVE_QLEN;
+    for (size_t i = 0; i < n; i++) {
+        struct in6_addr s6;
+        unsigned char *a = c->out + c->out_len;
+        memcpy(s6.s6_addr, c->in + i * SERVE_QLEN, SERVE_QLEN);
+        if (!nm_lookup(nm, &s6, answer_cb, a))
+            memset(a, 0, SERVE_ALEN);
+        c->out_len += SERVE_ALEN;
+    }
+    c->in_len -= n * SERVE_QLEN;
+    memmove(c->in, c->in + n * SERVE_QLEN, c->in_len);
+}
+
+/* -1 if the peer is gone, otherwise whatever fit has been sent */
+static int conn_send(struct conn *c) {
+    while (c->out_pos < c->out_len) {
+        ssize_t r = send(c->fd, c->out + c->out_pos,
+                c->out_len - c->out_pos, MSG_NOSIGNAL);
+        if (r < 0) return errno == EAGAIN || errno == EINTR ? 0 : -1;
+        c->out_pos += r;
+    }
+    c->out_pos = c->out_len = 0;
+    return 0;
+}
+
+/* answers go out before any more queries are read, so a client that
+ * stops reading only holds up itself.  0 once the peer is done. */
+static int conn_io(NM nm, struct conn *c) {
+    ssize_t r;
+
+    if (conn_send(c) < 0) return 0;
+    if (c->out_len) return 1;
+    r = read(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len);
+    if (r < 0) return errno == EAGAIN || errno == EINTR;
+    if (r == 0) return 0;
+    c->in_len += r;
+    answer(nm, c);
+    /* most of the time the answers fit in the socket buffer at once */
+    return conn_send(c) == 0;
+}
+
+static int server_listen(const char *path) {
+    struct sockaddr_un sa = { .sun_family = AF_UNIX };
+    struct stat st;
+    int fd;
+
+    if (strlen(path) >= sizeof(sa.sun_path)) {
+        warn("socket path too long: %s", path);
+        return -1;
+    }
+    strcpy(sa.sun_path, path);
+    /* clear out a socket left behind by an earlier run, but nothing else */
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+            bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 ||
+            listen(fd, SOMAXCONN) < 0 ||
+            fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+        warn("listen: %s", path);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int serve(const char *path, NM nm, serve_load_cb load, void *user) {
+    struct server sv = { .load = load, .user = user };
+    struct conn *conn[SERVE_CONNS];
+    struct pollfd pfd[SERVE_CONNS + 2];
+    struct snap *cur = calloc(1, sizeof(struct snap));
+    size_t nconn = 0;
+    pthread_t thread;
+    int lfd, rv = 0;
+
+    cur->nm = nm;
+    /* the reload thread takes these signals, nobody else */
+    sigemptyset(&sv.sigs);
+    sigaddset(&sv.sigs, SIGHUP);
+    sigaddset(&sv.sigs, SIGINT);
+    sigaddset(&sv.sigs, SIGTERM);
+    sigaddset(&sv.sigs, SERVE_SIG);
+    pthread_sigmask(SIG_BLOCK, &sv.sigs, NULL);
+    status("serving %zu nodes on %s", nm_nodes(), path);
+    if ((lfd = server_listen(path)) < 0) {
+        snap_free(cur);
+        return 1;
+    }
+    if (pipe(sv.wake) < 0 ||
+            fcntl(sv.wake[0], F_SETFL, O_NONBLOCK) < 0 ||
+            fcntl(sv.wake[1], F_SETFL, O_NONBLOCK) < 0 ||
+            (errno = pthread_create(&thread, NULL, reloader, &sv))) {
+        warn("serve");
+        close(lfd);
+        unlink(path);
+        snap_free(cur);
+        return 1;
+    }
+
+    while (!atomic_load(&sv.stop)) {
+        struct snap *s;
+        size_t i, n;
+
+        pfd[0] = (struct pollfd){ .fd = sv.wake[0], .events = POLLIN };
+        pfd[1] = (struct pollfd){ .fd = lfd,
+            .events = nconn < SERVE_CONNS ? POLLIN : 0 };
+        for (i = 0; i < nconn; i++)
+            pfd[i + 2] = (struct pollfd){ .fd = conn[i]->fd,
+                .events = conn[i]->out_len ? POLLOUT : POLLIN };
+        if (poll(pfd, nconn + 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            warn("poll");
+            rv = 1;
+            break;
+        }
+        if (pfd[0].revents) {
+            char buf[64];
+            while (read(sv.wake[0], buf, sizeof(buf)) > 0);
+        }
+        if ((s = atomic_exchange(&sv.pending, NULL))) {
+            snap_retire(&sv, cur);
+            cur = s;
+            pthread_kill(thread, SERVE_SIG);
+            status("now serving the reloaded set");
+        }
+        for (i = 0, n = nconn; i < n; i++) {
+            if (!pfd[i + 2].revents) continue;
+            if (conn_io(cur->nm, conn[i])) continue;
+            close(conn[i]->fd);
+            free(conn[i]);
+            conn[i] = NULL;
+        }
+        for (i = n = 0; i < nconn; i++)
+            if (conn[i]) conn[n++] = conn[i];
+        nconn = n;
+        while (pfd[1].revents && nconn < SERVE_CONNS) {
+            int fd = accept(lfd, NULL, NULL);
+            if (fd < 0) break;
+            fcntl(fd, F_SETFL, O_NONBLOCK);
+            conn[nconn] = calloc(1, sizeof(struct conn));
+            conn[nconn++]->fd = fd;
+        }
+    }
+
+    for (size_t i = 0; i < nconn; i++) {
+        close(conn[i]->fd);
+        free(conn[i]);
+    }
+    close(lfd);
+    unlink(path);
+    /* a reload in progress is left to finish, so nothing it holds leaks */
+    atomic_store(&sv.stop, 1);
+    pthread_kill(thread, SERVE_SIG);
+    pthread_join(thread, NULL);
+    close(sv.wake[0]);
+    close(sv.wake[1]);
+    snap_free(atomic_exchange(&sv.pending, NULL));
+    snap_free(atomic_exchange(&sv.retired, NULL));
+    snap_free(cur);
+    return rv;
+}
+
+/* client side */
+struct query {
+    int fd, misses;
+    MMDB db;
+    nm_walk_cb cb;
+    void *user;
+    size_t n;
+    nm_cidr q[SERVE_BATCH];
+};
+
+static int query_connect(const char *path) {
+    struct sockaddr_un sa = { .sun_family = AF_UNIX };
+    int fd;
+
+    if (strlen(path) >= sizeof(sa.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(sa.sun_path, path);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+QUERY query_open(const char *path, nm_walk_cb cb, void *user) {
+    struct stat st;
+    MMDB db = NULL;
+    int fd = -1;
+
+    /* a regular file is a database written by --mmdb */
+    if (!stat(path, &st) && S_ISREG(st.st_mode)) {
+        if (!(db = mmdb_open(path)))
+            return NULL;
+    } else if ((fd = query_connect(path)) < 0) {
+        return NULL;
+    }
+    QUERY q = calloc(1, sizeof(struct query));
+    q->fd = fd;
+    q->db = db;
+    q->cb = cb;
+    q->user = user;
+    return q;
+}
+
+static int query_io(int fd, void *buf, size_t len, int out) {
+    unsigned char *p = buf;
+    while (len) {
+        ssize_t r = out ? send(fd, p, len, MSG_NOSIGNAL) : read(fd, p, len);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        p += r;
+        len -= r;
+    }
+    return 0;
+}
+
+static int query_flush(QUERY q) {
+    unsigned char buf[SERVE_BATCH * SERVE_ALEN];
+    size_t i;
+
+    if (!q->n) return 0;
+    if (q->db) {
+        /* answered here, in the same form a server would use */
+        for (i = 0; i < q->n; i++)
+            if (!mmdb_lookup(q->db, &q->q[i].addr.s6, answer_cb,
+                        buf + i * SERVE_ALEN))
+                memset(buf + i * SERVE_ALEN, 0, SERVE_ALEN);
+    } else {
+        for (i = 0; i < q->n; i++)
+            memcpy(buf + i * SERVE_QLEN, q->q[i].addr.s6.s6_addr,
+                SERVE_QLEN);
+        if (query_io(q->fd, buf, q->n * SERVE_QLEN, 1) < 0 ||
+                query_io(q->fd, buf, q->n * SERVE_ALEN, 0) < 0) {
+            warn("query");
+            return -1;
+        }
+    }
+    for (i = 0; i < q->n; i++) {
+        unsigned char *a = buf + i * SERVE_ALEN;
+        if (a[17]) {
+            nm_cidr c = {
+                .domain = a[17] == 4 ? AF_INET : AF_INET6,
+                .scope = a[16],
+            };
+            memcpy(c.addr.s6.s6_addr, a, 16);
+            for (int b = 0; b < 16; b++) {
+                int bits = c.scope - 8 * b;
+                c.mask.s6.s6_addr[b] = bits >= 8 ? 0xff :
+                    bits > 0 ? 0xff << (8 - bits) : 0;
+            }
+            q->cb(&c, q->user);
+        } else {
+            char nb[INET6_ADDRSTRLEN];
+            nm_cidr *c = &q->q[i];
+            inet_ntop(c->domain, c->domain == AF_INET ?
+                (void *)&c->addr.s : (void *)&c->addr.s6, nb, sizeof(nb));
+            warn("%s not in set", nb);
+            q->misses++;
+        }
+    }
+    q->n = 0;
+    return 0;
+}
+
+struct query_add_ctx {
+    QUERY q;
+    int bad;
+};
+
+static void query_check_cb(nm_cidr *c, void *p) {
+    if (c->scope != 128) *(int *)p = 1;
+}
+
+static void query_add_cb(nm_cidr *c, void *p) {
+    struct query_add_ctx *ctx = p;
+    if (ctx->bad) return;
+    ctx->q->q[ctx->q->n++] = *c;
+    if (ctx->q->n == SERVE_BATCH && query_flush(ctx->q) < 0)
+        ctx->bad = -1;
+}
+
+int query_add(QUERY q, NM nm) {
+    struct query_add_ctx ctx = { .q = q };
+
+    /* a lost server has been reported already */
+    if (q->fd < 0 && !q->db) return 0;
+    /* nothing of a spec that is not all single addresses is queued */
+    nm_walk(nm, query_check_cb, &ctx.bad);
+    if (ctx.bad) return -1;
+    nm_walk(nm, query_add_cb, &ctx);
+    if (ctx.bad < 0) {
+        close(q->fd);
+        q->fd = -1;
+    }
+    return 0;
+}
+
+int query_close(QUERY q) {
+    int rv = (q->fd < 0 && !q->db) || query_flush(q) < 0 ? -1 : q->misses;
+    if (q->fd >= 0) close(q->fd);
+    if (q->db) mmdb_close(q->db);
+    free(q);
+    return rv;
+}
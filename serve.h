@@ -0,0 +1,56 @@
+/* serve.h - answer address queries over a unix socket
+ *
+ * Copyright (c) 2025  Robert Stone <talby@trap.mtview.ca.us>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+#ifndef _HAVE_SERVE_H
+#define _HAVE_SERVE_H
+
+#include "netmask.h"
+
+/* A query is a 16 byte address in network order, IPv4 addresses being
+ * written as ::ffff:a.b.c.d.  Queries may be sent back to back in any
+ * number and each one gets an 18 byte answer, in order: the covering
+ * prefix, its length and a family byte of 4 or 6 for the notation it
+ * was given in, or all zeros if the address is not in the set. */
+#define SERVE_QLEN 16
+#define SERVE_ALEN 18
+
+/* builds a fresh tree from the original sources, returns -1 if they
+ * could not be read */
+typedef int (*serve_load_cb)(NM *, void *);
+
+/* listen on path and answer queries from nm until SIGTERM or SIGINT.
+ * SIGHUP rebuilds the set with load on another thread and swaps it in
+ * between batches, queries keep being answered from the old set in the
+ * meantime.  Returns nonzero if the socket could not be set up. */
+int serve(const char *path, NM nm, serve_load_cb load, void *user);
+
+/* client side.  query_add() looks up every address in a tree, and
+ * returns -1 without looking any of them up if it holds anything wider
+ * than a single address.  Answers are handed to the walk callback in
+ * query order as they arrive, misses are reported by warning.
+ * query_close() returns the number of misses, or -1 if the server went
+ * away.  If path is a regular file it is taken to be a MaxMind DB and
+ * queries are answered from it directly. */
+typedef struct query *QUERY;
+
+QUERY query_open(const char *path, nm_walk_cb, void *);
+
+int query_add(QUERY, NM);
+
+int query_close(QUERY);
+#endif
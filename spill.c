@@ -0,0 +1,148 @@
+/* spill.c - out of core aggregation for netmask
+ *
+ * Copyright (c) 2025  Robert Stone <talby@trap.mtview.ca.us>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "errors.h"
+#include "netmask.h"
+#include "spill.h"
+
+/* Runs are kept like a binary counter in base fanin: whenever the top
+ * fanin runs share a level they are merged into one run a level up.
+ * That keeps the number of open runs logarithmic in the input size and
+ * preserves input order between runs, which decides ties. */
+struct run {
+    FILE *fp;
+    unsigned level;
+};
+
+struct spill {
+    /* base is how many nodes were in use before, by other trees */
+    size_t budget, base, fanin;
+    size_t n, cap;
+    struct run *runs;
+};
+
+SPILL spill_new(size_t limit) {
+    SPILL self = calloc(1, sizeof(struct spill));
+    self->budget = limit / nm_node_size();
+    if (self->budget < 1) self->budget = 1;
+    self->base = nm_nodes();
+    /* each run being merged holds a stdio buffer and a descriptor */
+    self->fanin = limit / BUFSIZ;
+    if (self->fanin < 2) self->fanin = 2;
+    if (self->fanin > 256) self->fanin = 256;
+    return self;
+}
+
+static FILE *run_open(void) {
+    const char *dir = getenv("TMPDIR");
+    char path[1024];
+    int fd;
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "%s/netmaskXXXXXX", dir ? dir : "/tmp");
+    if ((fd = mkstemp(path)) < 0)
+        panic("mkstemp: %s", path);
+    unlink(path);
+    if (!(fp = fdopen(fd, "w+b")))
+        panic("fdopen: %s", path);
+    return fp;
+}
+
+static void run_push(SPILL self, FILE *fp, unsigned level) {
+    if (self->n == self->cap) {
+        self->cap = self->cap ? 2 * self->cap : 16;
+        self->runs = realloc(self->runs, self->cap * sizeof(struct run));
+    }
+    if (fflush(fp) != 0)
+        panic("run write failed");
+    self->runs[self->n++] = (struct run){ fp, level };
+}
+
+/* merge the top k runs into one */
+static void run_merge(SPILL self, size_t k) {
+    FILE *out = run_open(), *in[k];
+    struct run *top = self->runs + self->n - k;
+    unsigned level = 0;
+
+    for (size_t i = 0; i < k; i++) {
+        in[i] = top[i].fp;
+        if (top[i].level >= level) level = top[i].level + 1;
+    }
+    if (nm_unspill(in, k, nm_spill_cb, out) < 0)
+        panic("run read failed");
+    for (size_t i = 0; i < k; i++)
+        fclose(in[i]);
+    self->n -= k;
+    status("merged %zu runs at level %u", k, level);
+    run_push(self, out, level);
+}
+
+static void run_spill(SPILL self, NM nm) {
+    FILE *fp = run_open();
+    size_t nodes = nm_nodes() - self->base;
+
+    if (nm_spill(nm, fp) < 0)
+        panic("run write failed");
+    run_push(self, fp, 0);
+    status("spilled %zu nodes to run %zu", nodes, self->n);
+    while (self->n >= self->fanin) {
+        struct run *top = self->runs + self->n - self->fanin;
+        size_t i;
+        for (i = 1; i < self->fanin; i++)
+            if (top[i].level != top[0].level) break;
+        if (i < self->fanin) break;
+        run_merge(self, self->fanin);
+    }
+}
+
+NM spill_check(SPILL self, NM nm) {
+    if (nm_nodes() - self->base <= self->budget) return nm;
+    run_spill(self, nm);
+    return NULL;
+}
+
+void spill_walk(SPILL self, NM *nm, nm_walk_cb cb, void *user) {
+    FILE *in[self->fanin];
+
+    if (self->n == 0) {
+        nm_walk(*nm, cb, user);
+        return;
+    }
+    if (*nm) run_spill(self, *nm);
+    *nm = NULL;
+    while (self->n > self->fanin)
+        run_merge(self, self->fanin);
+    for (size_t i = 0; i < self->n; i++)
+        in[i] = self->runs[i].fp;
+    if (nm_unspill(in, self->n, cb, user) < 0)
+        panic("run read failed");
+    for (size_t i = 0; i < self->n; i++)
+        fclose(in[i]);
+    self->n = 0;
+}
+
+void spill_free(SPILL self) {
+    for (size_t i = 0; i < self->n; i++)
+        fclose(self->runs[i].fp);
+    free(self->runs);
+    free(self);
+}
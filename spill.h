@@ -0,0 +1,42 @@
+/* spill.h - out of core aggregation for netmask
+ *
+ * Copyright (c) 2025  Robert Stone <talby@trap.mtview.ca.us>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+#ifndef _HAVE_SPILL_H
+#define _HAVE_SPILL_H
+
+#include "netmask.h"
+
+typedef struct spill *SPILL;
+
+/* limit is the memory ceiling in bytes, shared between tree nodes while
+ * ingesting and run buffers while merging.  Nodes already in use when
+ * this is called, such as a tree to diff against, are not counted. */
+SPILL spill_new(size_t limit);
+
+/* call after each merge into the tree.  If the tree has grown past the
+ * ceiling it is written out as a sorted run and NULL is returned,
+ * otherwise the tree is returned untouched. */
+NM spill_check(SPILL, NM);
+
+/* walk the union of all spilled runs and the remaining tree.  Without
+ * any runs this is just nm_walk(), otherwise the tree is spilled too
+ * and *nm is left NULL. */
+void spill_walk(SPILL, NM *, nm_walk_cb, void *);
+
+void spill_free(SPILL);
+#endif
@@ -1,6 +1,143 @@
+#ifndef _HAVE_U128_H
+#define _HAVE_U128_H
+
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
 #include <netinet/in.h>
 
-/* on a modern processor, this code has no loops */
+/* on a modern processor, this code has no loops
+ *
+ * There are two implementations of u128_t.  The portable one emulates
+ * 128 bit arithmetic with a pair of uint64_t, the other uses the
+ * compiler's unsigned __int128.  configure picks the native one where
+ * it is available unless told --disable-int128, defining USE_INT128.
+ * U128_STRUCT forces the portable one, which the tests rely on to
+ * check both.  Callers must stick to the functions below rather than
+ * poking at the representation, and must include config.h first so
+ * every file in a build agrees on the backend. */
+
+#if defined(USE_INT128) && !defined(U128_STRUCT)
+#  define U128_NATIVE 1
+#endif
+
+static inline uint8_t u64_popc(uint64_t v) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcountll((unsigned long long)v);
+#else
+    uint8_t i;
+    for (i = 0; v; i++) v &= v - 1;
+    return i;
+#endif
+}
+
+static inline uint8_t u64_clz(uint64_t v) {
+#if defined(__GNUC__) || defined(__clang__)
+    return v ? __builtin_clzll((unsigned long long)v) : 64;
+#else
+    uint8_t n = 0;
+    if (v == 0) return 64;
+    for (; (v & (1ULL << 63)) == 0; n++, v <<= 1);
+    return n;
+#endif
+}
+
+static inline uint8_t u64_ctz(uint64_t v) {
+#if defined(__GNUC__) || defined(__clang__)
+    return v ? __builtin_ctzll((unsigned long long)v) : 64;
+#else
+    uint8_t n = 0;
+    if (v == 0) return 64;
+    for (; (v & 1) == 0; n++, v >>= 1);
+    return n;
+#endif
+}
+
+/* big endian bytes to and from host order */
+static inline uint64_t u64_of_be(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return v;
+#elif defined(__GNUC__) || defined(__clang__)
+    return __builtin_bswap64(v);
+#else
+    return ((uint64_t)p[0] << 56) | ((uint64_t)p[1] << 48) |
+           ((uint64_t)p[2] << 40) | ((uint64_t)p[3] << 32) |
+           ((uint64_t)p[4] << 24) | ((uint64_t)p[5] << 16) |
+           ((uint64_t)p[6] <<  8) | ((uint64_t)p[7] <<  0);
+#endif
+}
+
+static inline void be_of_u64(uint8_t *p, uint64_t v) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    memcpy(p, &v, sizeof(v));
+#elif defined(__GNUC__) || defined(__clang__)
+    v = __builtin_bswap64(v);
+    memcpy(p, &v, sizeof(v));
+#else
+    for (int i = 7; i >= 0; i--, v >>= 8) p[i] = v & 0xff;
+#endif
+}
+
+/* the top n bits set, for 0 <= n <= 64, without branching */
+static inline uint64_t u64_mask(uint8_t n) {
+    return -(uint64_t)(n != 0) & (~0ULL << ((64 - n) & 63));
+}
+
+#ifdef U128_NATIVE
+
+typedef unsigned __int128 u128_t;
+
+static inline u128_t u128(uint64_t h, uint64_t l) {
+    return ((u128_t)h << 64) | l;
+}
+
+static inline uint64_t u128_hi(u128_t v) {
+    return v >> 64;
+}
+
+static inline uint64_t u128_lo(u128_t v) {
+    return (uint64_t)v;
+}
+
+static inline u128_t u128_add(u128_t x, u128_t y, int *carry) {
+    u128_t s = x + y;
+    if (carry) *carry = s < x;
+    return s;
+}
+
+static inline u128_t u128_and(u128_t x, u128_t y) { return x & y; }
+
+static inline u128_t u128_or(u128_t x, u128_t y) { return x | y; }
+
+static inline u128_t u128_xor(u128_t x, u128_t y) { return x ^ y; }
+
+static inline u128_t u128_not(u128_t v) { return ~v; }
+
+static inline int u128_cmp(u128_t x, u128_t y) {
+    /* return -1, 0, 1 on sort order */
+    return (x > y) - (x < y);
+}
+
+static inline u128_t u128_mask(uint8_t n) {
+    /* a variable 128 bit shift costs more than two 64 bit ones */
+    if (n > 128) n = 128;
+    uint8_t hn = n > 64 ? 64 : n;
+    return u128(u64_mask(hn), u64_mask(n - hn));
+}
+
+static inline int u128_is_valid_mask(u128_t mask) {
+    /* the inverse of a mask is one less than a power of two */
+    u128_t inv = ~mask;
+    return (inv & (inv + 1)) == 0;
+}
+
+static inline uint8_t u128_bit(u128_t v, uint8_t i) {
+    return i < 128 ? 1 & (uint8_t)(v >> (127 - i)) : 0;
+}
+
+#else /* U128_NATIVE */
 
 typedef struct {
     uint64_t h;
@@ -11,15 +148,20 @@ static inline u128_t u128(uint64_t h, uint64_t l) {
     return (u128_t){ h, l };
 }
 
+static inline uint64_t u128_hi(u128_t v) {
+    return v.h;
+}
+
+static inline uint64_t u128_lo(u128_t v) {
+    return v.l;
+}
+
 static inline u128_t u128_add(u128_t x, u128_t y, int *carry) {
-    /* this relies on the sum being greater than both terms of the
-     * addition, otherwise an overflow must have occurred. */
-    uint64_t h, l, c;
-
-    l = x.l + y.l;
-    c = (l < x.l || l < y.l) ? 1 : 0;
-    h = x.h + y.h + c;
-    if (carry) *carry = (h < x.h || h < y.h) ? 1 : 0;
+    /* an unsigned sum smaller than a term must have wrapped */
+    uint64_t l = x.l + y.l;
+    uint64_t c = l < x.l;
+    uint64_t h = x.h + y.h + c;
+    if (carry) *carry = h < x.h || (c && h == x.h);
     return u128(h, l);
 }
 
@@ -41,59 +183,19 @@ static inline u128_t u128_not(u128_t v) {
 
 static inline int u128_cmp(u128_t x, u128_t y) {
     /* return -1, 0, 1 on sort order */
-    if(x.h < y.h) return -1;
-    if(x.h > y.h) return 1;
-    if(x.l < y.l) return -1;
-    if(x.l > y.l) return 1;
-    return 0;
-}
-
-static inline u128_t u128_of_v4(struct in_addr *s) {
-    return u128(0, ((uint64_t)0xffff << 32) | ntohl(s->s_addr));
-}
-
-static inline struct in_addr v4_of_u128(u128_t v) {
-    return (struct in_addr){ htonl(v.l & 0xffffffff) };
-}
-
-static inline u128_t u128_of_v6(struct in6_addr *s6) {
-    const uint8_t *addr = s6->s6_addr;
-    return u128(
-        (((uint64_t)addr[0])  << 56) | (((uint64_t)addr[1])  << 48) |
-        (((uint64_t)addr[2])  << 40) | (((uint64_t)addr[3])  << 32) |
-        (((uint64_t)addr[4])  << 24) | (((uint64_t)addr[5])  << 16) |
-        (((uint64_t)addr[6])  <<  8) | (((uint64_t)addr[7])  <<  0),
-        (((uint64_t)addr[8])  << 56) | (((uint64_t)addr[9])  << 48) |
-        (((uint64_t)addr[10]) << 40) | (((uint64_t)addr[11]) << 32) |
-        (((uint64_t)addr[12]) << 24) | (((uint64_t)addr[13]) << 16) |
-        (((uint64_t)addr[14]) <<  8) | (((uint64_t)addr[15]) <<  0)
-    );
-}
-
-static inline struct in6_addr v6_of_u128(u128_t v) {
-    return (struct in6_addr){
-        .s6_addr = {
-            (uint8_t)0xff & (v.h >> 56), (uint8_t)0xff & (v.h >> 48),
-            (uint8_t)0xff & (v.h >> 40), (uint8_t)0xff & (v.h >> 32),
-            (uint8_t)0xff & (v.h >> 24), (uint8_t)0xff & (v.h >> 16),
-            (uint8_t)0xff & (v.h >>  8), (uint8_t)0xff & (v.h >>  0),
-            (uint8_t)0xff & (v.l >> 56), (uint8_t)0xff & (v.l >> 48),
-            (uint8_t)0xff & (v.l >> 40), (uint8_t)0xff & (v.l >> 32),
-            (uint8_t)0xff & (v.l >> 24), (uint8_t)0xff & (v.l >> 16),
-            (uint8_t)0xff & (v.l >>  8), (uint8_t)0xff & (v.l >>  0),
-        }
-    };
+    int h = (x.h > y.h) - (x.h < y.h);
+    int l = (x.l > y.l) - (x.l < y.l);
+    return h ? h : l;
 }
 
 static inline u128_t u128_mask(uint8_t n) {
     if (n > 128) n = 128;
-    if (n > 64) return u128(~0ULL, ~0ULL << (128 - n));
-    if (n > 0) return u128(~0ULL << (64 - n), 0);
-    return u128(0, 0);
+    uint8_t hn = n > 64 ? 64 : n;
+    return u128(u64_mask(hn), u64_mask(n - hn));
 }
 
 static inline int u128_is_valid_mask(u128_t mask) {
-    if (mask.l && !mask.h) return 0;
+    if (mask.l && ~mask.h) return 0;
     if ((~mask.h + 1) & ~mask.h) return 0;
     if ((~mask.l + 1) & ~mask.l) return 0;
     return 1;
@@ -105,39 +207,38 @@ static inline uint8_t u128_bit(u128_t v, uint8_t i) {
     return 0;
 }
 
-static inline uint8_t u64_popc(uint64_t v) {
-#if defined(__GNUC__) || defined(__clang__)
-    return __builtin_popcountll((unsigned long long)v);
-#else
-    uint8_t i;
-    for (i = 0; v; i++) v &= v - 1;
-    return i;
-#endif
+#endif /* U128_NATIVE */
+
+static inline u128_t u128_of_v4(struct in_addr *s) {
+    return u128(0, ((uint64_t)0xffff << 32) | ntohl(s->s_addr));
 }
 
-static inline uint8_t u128_popc(u128_t v) {
-    return u64_popc(v.h) + u64_popc(v.l);
+static inline struct in_addr v4_of_u128(u128_t v) {
+    return (struct in_addr){ htonl(u128_lo(v) & 0xffffffff) };
 }
 
-static inline uint8_t u64_clz(uint64_t v) {
-#if defined(__GNUC__) || defined(__clang__)
-    return v ? __builtin_clzll((unsigned long long)v) : 64;
-#else
-    uint8_t n = 0;
-    if (v == 0) return 64;
-    for (; (v & (1ULL << 63)) == 0; n++, v <<= 1);
-    return n;
-#endif
+static inline u128_t u128_of_v6(struct in6_addr *s6) {
+    return u128(u64_of_be(s6->s6_addr), u64_of_be(s6->s6_addr + 8));
+}
+
+static inline struct in6_addr v6_of_u128(u128_t v) {
+    struct in6_addr s6;
+    be_of_u64(s6.s6_addr, u128_hi(v));
+    be_of_u64(s6.s6_addr + 8, u128_lo(v));
+    return s6;
+}
+
+static inline uint8_t u128_popc(u128_t v) {
+    return u64_popc(u128_hi(v)) + u64_popc(u128_lo(v));
 }
 
 static inline uint8_t u128_clz(u128_t v) {
-    if (v.h)
-        return u64_clz(v.h);
-    else
-        return 64 + u64_clz(v.l);
+    uint64_t h = u128_hi(v);
+    return h ? u64_clz(h) : 64 + u64_clz(u128_lo(v));
 }
 
 /* longest common prefix */
 static inline uint8_t u128_lcp(u128_t x, u128_t y) {
     return u128_clz(u128_xor(x, y));
 }
+#endif
@@ -0,0 +1,93 @@
+/* u128_bench.c - time the u128.h primitives
+ *
+ * Copyright (c) 2025  Robert Stone <talby@trap.mtview.ca.us>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+/* Built like u128_test, once per backend; "make bench" runs both. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "u128.h"
+
+#define NVALS 4096
+#define ROUNDS 4096
+
+static u128_t vals[NVALS];
+static struct in6_addr addrs[NVALS];
+
+static inline int add_carry(u128_t x, u128_t y) {
+    int c;
+    u128_add(x, y, &c);
+    return c;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* run expr over every pair of neighbours, folding the results into sink
+ * so the compiler cannot drop the work */
+#define BENCH(name, expr) do { \
+    uint64_t sink = 0; \
+    double t = now(); \
+    for (int r = 0; r < ROUNDS; r++) { \
+        for (int i = 0; i < NVALS; i++) { \
+            u128_t x = vals[i], y = vals[(i + r) & (NVALS - 1)]; \
+            (void)x; (void)y; \
+            sink += (expr); \
+        } \
+    } \
+    t = now() - t; \
+    printf("%-16s %6.2f ns/op  (%016llx)\n", name, \
+        t * 1e9 / ((double)NVALS * ROUNDS), (unsigned long long)sink); \
+} while (0)
+
+int main(void) {
+    uint64_t s = 0x243f6a8885a308d3ULL;
+
+    for (int i = 0; i < NVALS; i++) {
+        uint64_t h, l;
+        s ^= s << 13; s ^= s >> 7; s ^= s << 17; h = s;
+        s ^= s << 13; s ^= s >> 7; s ^= s << 17; l = s;
+        /* share prefixes the way real address lists do */
+        if (i & 1) h = u128_hi(vals[i - 1]);
+        vals[i] = u128(h, l);
+        addrs[i] = v6_of_u128(vals[i]);
+    }
+
+    printf("u128 backend: %s\n",
+#ifdef U128_NATIVE
+        "unsigned __int128"
+#else
+        "struct"
+#endif
+        );
+    BENCH("u128_add", u128_lo(u128_add(x, y, NULL)));
+    BENCH("u128_add carry", add_carry(x, y));
+    BENCH("u128_and", u128_lo(u128_and(x, y)));
+    BENCH("u128_cmp", u128_cmp(x, y) < 0);
+    BENCH("u128_mask", u128_hi(u128_mask(u128_lo(y) & 0xff)));
+    BENCH("u128_is_valid", u128_is_valid_mask(u128_mask(u128_lo(y) & 0x7f)));
+    BENCH("u128_bit", u128_bit(x, u128_lo(y) & 0x7f));
+    BENCH("u128_lcp", u128_lcp(x, y));
+    BENCH("u128_of_v6", u128_lo(u128_of_v6(&addrs[(i + r) & (NVALS - 1)])));
+    BENCH("v6_of_u128", v6_of_u128(y).s6_addr[15]);
+    return 0;
+}
@@ -0,0 +1,264 @@
+/* u128_test.c - check u128.h against a bit at a time reference
+ *
+ * Copyright (c) 2025  Robert Stone <talby@trap.mtview.ca.us>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
+
+/* This is built once with U128_STRUCT and once with USE_INT128, so
+ * both backends are held to the same slow but obvious reference. */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <check.h>
+
+#include "u128.h"
+
+typedef struct { uint64_t h, l; } ref_t;
+
+static int ref_bit(ref_t v, int i) {
+    return i < 64 ? (v.h >> (63 - i)) & 1 : (v.l >> (127 - i)) & 1;
+}
+
+static void ref_set(ref_t *v, int i, int b) {
+    uint64_t *w = i < 64 ? &v->h : &v->l;
+    uint64_t m = 1ULL << (63 - (i & 63));
+    *w = b ? *w | m : *w & ~m;
+}
+
+static ref_t ref_add(ref_t x, ref_t y, int *carry) {
+    ref_t s = { 0, 0 };
+    int c = 0;
+    for (int i = 127; i >= 0; i--) {
+        int t = ref_bit(x, i) + ref_bit(y, i) + c;
+        ref_set(&s, i, t & 1);
+        c = t >> 1;
+    }
+    *carry = c;
+    return s;
+}
+
+static int ref_cmp(ref_t x, ref_t y) {
+    for (int i = 0; i < 128; i++)
+        if (ref_bit(x, i) != ref_bit(y, i))
+            return ref_bit(x, i) ? 1 : -1;
+    return 0;
+}
+
+static ref_t ref_mask(int n) {
+    ref_t m = { 0, 0 };
+    for (int i = 0; i < n && i < 128; i++)
+        ref_set(&m, i, 1);
+    return m;
+}
+
+static int ref_is_mask(ref_t v) {
+    int i = 0;
+    while (i < 128 && ref_bit(v, i)) i++;
+    while (i < 128 && !ref_bit(v, i)) i++;
+    return i == 128;
+}
+
+static int ref_popc(ref_t v) {
+    int n = 0;
+    for (int i = 0; i < 128; i++) n += ref_bit(v, i);
+    return n;
+}
+
+static int ref_clz(ref_t v) {
+    int i = 0;
+    while (i < 128 && !ref_bit(v, i)) i++;
+    return i;
+}
+
+static u128_t to(ref_t v) {
+    return u128(v.h, v.l);
+}
+
+#define ck_assert_u128(a, r) do { \
+    u128_t _a = (a); ref_t _r = (r); \
+    ck_assert_uint_eq(u128_hi(_a), _r.h); \
+    ck_assert_uint_eq(u128_lo(_a), _r.l); \
+} while (0)
+
+/* every single bit, every mask and its inverse, and some noise */
+static ref_t *vals;
+static size_t nvals;
+
+static uint64_t rnd(void) {
+    static uint64_t s = 0x243f6a8885a308d3ULL;
+    s ^= s << 13;
+    s ^= s >> 7;
+    s ^= s << 17;
+    return s;
+}
+
+static void vals_setup(void) {
+    vals = malloc(sizeof(ref_t) * 600);
+    nvals = 0;
+    for (int i = 0; i < 128; i++) {
+        ref_t v = { 0, 0 };
+        ref_set(&v, i, 1);
+        vals[nvals++] = v;
+    }
+    for (int n = 0; n <= 128; n++) {
+        ref_t m = ref_mask(n);
+        vals[nvals++] = m;
+        vals[nvals++] = (ref_t){ ~m.h, ~m.l };
+    }
+    vals[nvals++] = (ref_t){ 0, 0xffffffffULL };
+    vals[nvals++] = (ref_t){ 0, 0xffffffffffffULL };
+    vals[nvals++] = (ref_t){ 0x20010db800000000ULL, 0x0000ff0000428329ULL };
+    while (nvals < 600)
+        vals[nvals++] = (ref_t){ rnd(), rnd() };
+}
+
+static void vals_teardown(void) {
+    free(vals);
+}
+
+START_TEST(test_parts) {
+    for (size_t i = 0; i < nvals; i++)
+        ck_assert_u128(to(vals[i]), vals[i]);
+}
+END_TEST
+
+START_TEST(test_add) {
+    for (size_t i = 0; i < nvals; i++) {
+        for (size_t j = 0; j < nvals; j++) {
+            int c, rc;
+            ref_t r = ref_add(vals[i], vals[j], &rc);
+            ck_assert_u128(u128_add(to(vals[i]), to(vals[j]), &c), r);
+            ck_assert_int_eq(c, rc);
+            ck_assert_u128(u128_add(to(vals[i]), to(vals[j]), NULL), r);
+        }
+    }
+}
+END_TEST
+
+START_TEST(test_logic) {
+    for (size_t i = 0; i < nvals; i++) {
+        ref_t x = vals[i];
+        ck_assert_u128(u128_not(to(x)), ((ref_t){ ~x.h, ~x.l }));
+        for (size_t j = 0; j < nvals; j++) {
+            ref_t y = vals[j];
+            ck_assert_u128(u128_and(to(x), to(y)),
+                ((ref_t){ x.h & y.h, x.l & y.l }));
+            ck_assert_u128(u128_or(to(x), to(y)),
+                ((ref_t){ x.h | y.h, x.l | y.l }));
+            ck_assert_u128(u128_xor(to(x), to(y)),
+                ((ref_t){ x.h ^ y.h, x.l ^ y.l }));
+        }
+    }
+}
+END_TEST
+
+START_TEST(test_cmp) {
+    for (size_t i = 0; i < nvals; i++)
+        for (size_t j = 0; j < nvals; j++)
+            ck_assert_int_eq(u128_cmp(to(vals[i]), to(vals[j])),
+                ref_cmp(vals[i], vals[j]));
+}
+END_TEST
+
+START_TEST(test_mask) {
+    /* past 128 the mask saturates */
+    for (int n = 0; n < 256; n++)
+        ck_assert_u128(u128_mask(n), ref_mask(n));
+}
+END_TEST
+
+START_TEST(test_is_valid_mask) {
+    for (size_t i = 0; i < nvals; i++)
+        ck_assert_int_eq(u128_is_valid_mask(to(vals[i])),
+            ref_is_mask(vals[i]));
+    /* a mask with one stray bit flipped never is */
+    for (int n = 0; n <= 128; n++) {
+        for (int i = 0; i < 128; i++) {
+            ref_t m = ref_mask(n);
+            ref_set(&m, i, !ref_bit(m, i));
+            ck_assert_int_eq(u128_is_valid_mask(to(m)), ref_is_mask(m));
+        }
+    }
+}
+END_TEST
+
+START_TEST(test_bits) {
+    for (size_t i = 0; i < nvals; i++) {
+        ref_t x = vals[i];
+        for (int b = 0; b < 256; b++)
+            ck_assert_int_eq(u128_bit(to(x), b), b < 128 ? ref_bit(x, b) : 0);
+        ck_assert_int_eq(u128_popc(to(x)), ref_popc(x));
+        ck_assert_int_eq(u128_clz(to(x)), ref_clz(x));
+        for (size_t j = 0; j < nvals; j++) {
+            ref_t y = vals[j];
+            ck_assert_int_eq(u128_lcp(to(x), to(y)),
+                ref_clz((ref_t){ x.h ^ y.h, x.l ^ y.l }));
+        }
+    }
+}
+END_TEST
+
+START_TEST(test_v6) {
+    for (size_t i = 0; i < nvals; i++) {
+        ref_t x = vals[i];
+        struct in6_addr s6 = v6_of_u128(to(x));
+        /* network byte order, most significant first */
+        for (int b = 0; b < 128; b++)
+            ck_assert_int_eq((s6.s6_addr[b / 8] >> (7 - b % 8)) & 1,
+                ref_bit(x, b));
+        ck_assert_u128(u128_of_v6(&s6), x);
+    }
+}
+END_TEST
+
+START_TEST(test_v4) {
+    for (size_t i = 0; i < nvals; i++) {
+        struct in_addr s = { htonl((uint32_t)vals[i].l) };
+        ref_t r = { 0, 0xffff00000000ULL | (uint32_t)vals[i].l };
+        ck_assert_u128(u128_of_v4(&s), r);
+        s = v4_of_u128(to(vals[i]));
+        ck_assert_uint_eq(ntohl(s.s_addr), (uint32_t)vals[i].l);
+    }
+}
+END_TEST
+
+static Suite *u128_suite(void) {
+    Suite *s = suite_create("u128");
+    TCase *tc = tcase_create("primitives");
+
+    tcase_add_checked_fixture(tc, vals_setup, vals_teardown);
+    tcase_set_timeout(tc, 60);
+    tcase_add_test(tc, test_parts);
+    tcase_add_test(tc, test_add);
+    tcase_add_test(tc, test_logic);
+    tcase_add_test(tc, test_cmp);
+    tcase_add_test(tc, test_mask);
+    tcase_add_test(tc, test_is_valid_mask);
+    tcase_add_test(tc, test_bits);
+    tcase_add_test(tc, test_v6);
+    tcase_add_test(tc, test_v4);
+    suite_add_tcase(s, tc);
+    return s;
+}
+
+int main(void) {
+    SRunner *sr = srunner_create(u128_suite());
+    int failed;
+
+    srunner_run_all(sr, CK_NORMAL);
+    failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}